@@ -35,14 +35,192 @@
 NS_EXPORT int Ns_ModuleVersion = 1;
 
 
+/*
+ * The following defines how a handle waits for a locked database.
+ */
+
+#define LITE_BUSY_TIMEOUT 0  /* Sleep on the sqlite schedule up to a timeout. */
+#define LITE_BUSY_BACKOFF 1  /* Exponential backoff with jitter. */
+#define LITE_BUSY_NOTIFY  2  /* Block on sqlite3_unlock_notify (shared cache). */
+
+/*
+ * The following defines what a handle holds the write lock for.
+ */
+
+#define LITE_LOCK_NONE 0
+#define LITE_LOCK_STMT 1  /* Until the current statement completes. */
+#define LITE_LOCK_TXN  2  /* Until the transaction commits or rolls back. */
+
+/*
+ * The following are the schemas a statement writes, bit 0 for main
+ * and bit i for the i'th shard.
+ */
+
+#define LITE_SCHEMA_ALL  (~0u)
+
+/*
+ * Shards are limited to the bits of the 32-bit write mask left after
+ * bit 0, which is reserved for main.
+ */
+
+#define LITE_MAX_SHARDS  31
+
+/*
+ * The following are the formats of dbilite::export.
+ */
+
+#define LITE_EXPORT_CSV   0
+#define LITE_EXPORT_JSON  1
+#define LITE_EXPORT_JSONL 2
+
+/*
+ * The following structure serializes writers to a database file
+ * across all pools and handles in the order they arrive.
+ */
+
+typedef struct LiteFile {
+    Ns_Mutex       lock;
+    Ns_Cond        cond;
+    unsigned long  next;     /* Next ticket to hand out. */
+    unsigned long  serving;  /* Ticket which holds the write lock. */
+    Tcl_HashTable  skipped;  /* Tickets given up after busytimeout. */
+    uintptr_t      owner;    /* Thread holding the write lock, or 0. */
+} LiteFile;
+
+/*
+ * The following defines how text values are bound in Exec().
+ */
+
+#define LITE_BIND_TEXT    0  /* Everything is text. */
+#define LITE_BIND_INTEGER 1  /* Canonical integers as int64. */
+#define LITE_BIND_NUMERIC 2  /* Also canonical reals as double. */
+
+/*
+ * The following index the transaction control statements which
+ * are prepared once per handle.
+ */
+
+#define LITE_TXN_BEGIN           0
+#define LITE_TXN_BEGIN_IMMEDIATE 1
+#define LITE_TXN_BEGIN_EXCLUSIVE 2
+#define LITE_TXN_COMMIT          3
+#define LITE_TXN_ROLLBACK        4
+#define LITE_TXN_SAVEPOINT       5
+#define LITE_TXN_RELEASE         6
+#define LITE_TXN_ROLLBACK_TO     7
+#define LITE_TXN_NUM             8
+
+#define LITE_MEM_NUM             4
+
+/*
+ * The following structure counts what a handle did. Counters are
+ * updated only by the thread using the handle and summed per pool
+ * by dbilite::stats.
+ */
+
+typedef struct LiteStats {
+    Tcl_WideInt  steps;        /* Calls to sqlite3_step(). */
+    Tcl_WideInt  rows;         /* Rows returned. */
+    Tcl_WideInt  busy;         /* Steps which waited for a lock. */
+    Tcl_WideInt  prepares;     /* Statements compiled. */
+    Tcl_WideInt  reuses;       /* Statements reused from a cache. */
+    Tcl_WideInt  finalizes;    /* Statements finalized. */
+    Tcl_WideInt  transactions; /* Transactions begun. */
+    Tcl_WideInt  errors;       /* Errors reported. */
+    Tcl_WideInt  slow;         /* Statements over slowquerytime. */
+    Tcl_WideInt  timeouts;     /* Statements over statementtimeout. */
+    Tcl_WideInt  interrupts;   /* Statements stopped by dbilite::interrupt. */
+    Tcl_WideInt  checkpoints;  /* WAL checkpoints run. */
+    Tcl_WideInt  optimizes;    /* PRAGMA optimize runs. */
+    Tcl_WideInt  vacuumed;     /* Free pages released by incremental_vacuum. */
+    Tcl_WideInt  cacheHits;    /* Queries answered from the result cache. */
+    Tcl_WideInt  cacheMisses;  /* Cacheable queries run by sqlite. */
+    Ns_Time      busyWait;     /* Time waiting for sqlite locks. */
+    Ns_Time      lockWait;     /* Time waiting for the write lock. */
+    Ns_Time      checkpointTime; /* Time running checkpoints. */
+    Ns_Time      maintenanceTime; /* Time running maintenance. */
+    int          walPages;     /* Pool WAL size at the last checkpoint. */
+    Tcl_WideInt  memory[LITE_MEM_NUM]; /* sqlite3_db_status at last reset. */
+} LiteStats;
+
+struct LiteQueue;
+struct LiteReplica;
+struct LiteCache;
+struct LiteHandle;
+
+#ifdef SQLITE_ENABLE_SNAPSHOT
+
+/*
+ * The following structure is a read snapshot made by dbilite::snapshot
+ * and in use by dbilite::with_snapshot in refCount threads.
+ */
+
+typedef struct LiteSnapshot {
+    sqlite3_snapshot *snapshot;
+    int               refCount;
+    int               released;  /* Freed by dbilite::snapshot_free. */
+} LiteSnapshot;
+
+#endif
+
 /*
  * The following structure manages per-pool configuration.
  */
 
 typedef struct LiteConfig {
     CONST char  *module;
+    CONST char  *server;     /* Server of private pools, or NULL. */
+    int          isDefault;  /* Default pool for driver commands. */
     CONST char  *datasource; /* The file containing the database. */
-    int          retries;    /* Number of times to retry a busy op. */
+    sqlite3     *keeper;     /* Keeps a sharedmemory database alive, or NULL. */
+    int          retries;    /* Max times the busy handler may sleep. */
+    int          busyMode;   /* LITE_BUSY_* strategy. */
+    int          busyTimeout;/* Max msec to wait for a lock. */
+    int          backoffMin; /* Initial backoff msec. */
+    int          backoffMax; /* Max backoff msec. */
+    CONST char  *pragmas;    /* Pragmas run on each new connection, or NULL. */
+    CONST char  *journal;    /* Configured journal_mode, or NULL. */
+    int          openFlags;  /* Flags for sqlite3_open_v2(). */
+    int          immutable;  /* The database never changes. */
+    LiteFile    *file;       /* Write lock if serializewrites, or NULL. */
+    int          numShards;  /* Databases attached to each handle. */
+    CONST char **shardNames; /* Schema names of the shards. */
+    CONST char **shardPaths; /* Datasources of the shards. */
+    LiteFile   **shardFiles; /* Write locks of the shards, or NULL. */
+    int          functions;  /* Register the built-in SQL functions. */
+    int          numExtensions;
+    CONST char **extensions; /* Paths of extensions to load. */
+    CONST char **entryPoints; /* Their entry points, or NULL for sqlite's. */
+    int          maxHandles; /* Max handles and aux connections, or 0. */
+    int          openHandles; /* Connections to open at startup. */
+    int          numWarmQueries;
+    CONST char **warmQueries; /* Run once at startup to load pages. */
+    int          warmFile;   /* Read the database file at startup. */
+    struct LiteQueue *queue; /* Group commit queue, or NULL. */
+    struct LiteReplica *replica; /* Disk copy of a replica pool, or NULL. */
+    struct LiteCache *cache; /* Result cache, or NULL. */
+    int          bindMode;   /* LITE_BIND_* for text values. */
+    CONST char  *prewarm;    /* Statements prepared by Open(), or NULL. */
+    int          slowTime;   /* Log statements slower than this msec, or 0. */
+    int          stmtTimeout; /* Msec a statement may run, or 0. */
+    int          idleMemory; /* KB of page cache kept by reset, or -1. */
+    int          lookasideSize;  /* Bytes per lookaside slot, or 0. */
+    int          lookasideCount; /* Lookaside slots per connection. */
+    int          checkpointInterval; /* Seconds between checkpoints, or 0. */
+    int          checkpointLimit;    /* WAL pages which force a truncate. */
+    struct LiteHandle *checkpointPtr; /* Connection for checkpoints. */
+    int          optimize;   /* Run PRAGMA optimize on close and maintenance. */
+    int          maintenanceInterval; /* Seconds between maintenance runs, or 0. */
+    int          maintenanceTime;     /* Msec budget of a maintenance run. */
+    int          vacuumPages;         /* Pages per incremental_vacuum slice, or 0. */
+    struct LiteHandle *maintenancePtr; /* Connection for maintenance. */
+    Ns_Mutex     lock;       /* Protects the following. */
+    struct LiteHandle *auxPtr; /* Idle connections for driver commands. */
+    int          numOpen;    /* Handles opened by nsdbi. */
+    int          numAux;     /* Connections for driver commands. */
+    struct LiteHandle *sparePtr; /* Connections opened at startup for Open(). */
+    struct LiteHandle *livePtr; /* All open handles. */
+    LiteStats    stats;      /* Totals of closed handles. */
 } LiteConfig;
 
 /*
@@ -50,11 +228,145 @@ typedef struct LiteConfig {
  */
 
 typedef struct LiteHandle {
+    struct LiteHandle *nextPtr; /* Next idle aux handle. */
+    struct LiteHandle *nextLivePtr, *prevLivePtr;
     LiteConfig  *ltCfg;
     sqlite3     *conn;
     Dbi_Handle  *handle;
+    int          busy;       /* Busy handler invoked during this step. */
+    Ns_Time      busyStart;  /* When the current wait started. */
+    int          writeLock;  /* LITE_LOCK_* held on ltCfg->file. */
+    unsigned int writeMask;  /* Schemas whose write lock is held. */
+    unsigned int authMask;   /* Schemas written by the statement being prepared. */
+    int          authVolatile; /* It calls a function whose result may change. */
+    int          running;    /* A statement is executing. */
+    Ns_Time      stmtStart;  /* When the current statement began. */
+    int          timeout;    /* Msec timeout of the statement, or 0. */
+    Ns_Time      deadline;   /* When the statement times out. */
+    int          timedOut;   /* Progress handler interrupted the statement. */
+    LiteStats    stats;
+    sqlite3_stmt *txnStmts[LITE_TXN_NUM]; /* Prepared on first use. */
+    sqlite3_stmt *cellStmt;  /* Statement of the cached cell, or NULL. */
+    unsigned int  cellIndex; /* Column of the cached cell. */
+    CONST void   *cellData;  /* Value owned by sqlite until next step. */
+    size_t        cellLength;
+    int           cellBinary;
+    char          cellBuf[24]; /* Text of an integer cell. */
+    Tcl_HashTable warm;      /* Prewarmed statements not yet used by nsdbi. */
+    Tcl_HashTable masks;     /* Schemas written by each statement. */
+    Tcl_HashTable uncached;  /* Statements whose results aren't cached. */
+    struct LiteResult *hitPtr; /* Cached result being returned, or NULL. */
+    sqlite3_stmt *hitStmt;   /* Statement answered by hitPtr. */
+    int           hitRow;    /* Current row of hitPtr. */
+    sqlite3_stmt *fillStmt;  /* Statement whose rows are being cached, or NULL. */
+    unsigned long fillGeneration; /* Cache generation when the query began. */
+    int           fillRows;
+    Ns_DString    fillKey;   /* SQL and values of the query. */
+    Ns_DString    fillCells; /* LiteCell of each value. */
+    Ns_DString    fillData;  /* Values. */
+    sqlite3_stmt *versionStmt; /* pragma data_version, prepared on first use. */
+    unsigned int  dataVersion; /* Last seen SQLITE_FCNTL_DATA_VERSION. */
 } LiteHandle;
 
+/*
+ * The following structures manage the result cache of a pool. Each
+ * result holds a copy of the rows of a query, keyed by its SQL and
+ * bound values, and is served only while the cache generation is
+ * unchanged. A handle which sees the database change bumps the
+ * generation.
+ */
+
+typedef struct LiteCell {
+    int           type;      /* SQLITE_NULL, SQLITE_BLOB or SQLITE_TEXT. */
+    size_t        offset;    /* Offset of the value in data. */
+    size_t        length;
+} LiteCell;
+
+typedef struct LiteResult {
+    struct LiteResult *nextPtr, *prevPtr; /* LRU list, most recent first. */
+    Tcl_HashEntry *hPtr;     /* Entry in the cache, or NULL if removed. */
+    unsigned long  generation;
+    int            refCount; /* Handles returning this result. */
+    unsigned int   numCols;
+    int            numRows;
+    size_t         size;
+    LiteCell      *cells;    /* numRows * numCols cells. */
+    char          *data;
+} LiteResult;
+
+typedef struct LiteCache {
+    Ns_Mutex       lock;
+    Tcl_HashTable  results;  /* LiteResult by key. */
+    LiteResult    *firstPtr, *lastPtr;
+    size_t         size;     /* Bytes used by results. */
+    size_t         maxSize;
+    size_t         maxResult; /* Larger results aren't cached. */
+    unsigned long  generation;
+} LiteCache;
+
+/*
+ * The following structure is a DML statement submitted to the
+ * group commit queue by a request thread.
+ */
+
+typedef struct LiteWrite {
+    struct LiteWrite  *nextPtr;
+    CONST char        *sql;
+    int                length;
+    Dbi_Value         *values;
+    unsigned int       numValues;
+    int                done;      /* Set by the writer when complete. */
+    char              *errmsg;    /* Error message, or NULL on success. */
+} LiteWrite;
+
+/*
+ * The following structure is a thread opening a connection at
+ * startup, the first of which also warms the database pages.
+ */
+
+typedef struct LiteWarm {
+    LiteConfig *ltCfg;
+    int         first;
+    Ns_Thread   thread;
+} LiteWarm;
+
+/*
+ * The following structure manages the group commit queue and
+ * the background writer thread which drains it.
+ */
+
+typedef struct LiteQueue {
+    LiteHandle        *ltHandle;  /* Writer connection. */
+    Ns_Mutex           lock;
+    Ns_Cond            cond;      /* Signalled when writes are queued. */
+    Ns_Cond            doneCond;  /* Broadcast when a batch completes. */
+    LiteWrite         *firstPtr;
+    LiteWrite        **lastPtrPtr;
+    int                length;
+    int                maxBatch;  /* Max writes per transaction. */
+    int                delay;     /* Msec to wait for a batch to fill. */
+    int                shutdown;
+    Ns_Thread          thread;
+    Tcl_HashTable      stmts;     /* Prepared statements by SQL. */
+} LiteQueue;
+
+/*
+ * The following structure manages writing an in-memory replica
+ * back to its file on disk.
+ */
+
+typedef struct LiteReplica {
+    LiteConfig    *ltCfg;
+    CONST char    *path;      /* File the replica was loaded from. */
+    int            interval;  /* Seconds between write-backs, or 0. */
+    int            pages;     /* Pages copied per backup step. */
+    unsigned int   version;   /* Data version last written back. */
+    Ns_Mutex       lock;
+    Ns_Cond        cond;      /* Signalled at shutdown. */
+    int            shutdown;
+    Ns_Thread      thread;
+} LiteReplica;
+
 /*
  * Static functions defined in this file.
  */
@@ -78,12 +390,335 @@ NS_EXPORT Ns_ModuleInitProc Ns_ModuleInit;
 
 static int Step(Dbi_Handle *handle, Dbi_Statement *stmt);
 static void ReportException(LiteHandle *ltHandle);
+static void LockException(LiteHandle *ltHandle);
+static int StepStmt(LiteHandle *ltHandle, sqlite3_stmt *st, Ns_Time *waitPtr);
+static void StartStatement(LiteHandle *ltHandle);
+static void SampleMemory(LiteHandle *ltHandle);
+static int ProgressHandler(void *arg);
+
+static LiteHandle *NewHandle(LiteConfig *ltCfg, Ns_DString *dsPtr);
+static void FreeHandle(LiteHandle *ltHandle);
+static int BindValues(sqlite3_stmt *st, Dbi_Value *values,
+                      unsigned int numValues, int bindMode);
+static int BindText(sqlite3_stmt *st, int index, CONST char *data,
+                    size_t length, int bindMode);
+static int ParseInteger(CONST char *data, size_t length, sqlite3_int64 *iPtr);
+static int ParseReal(CONST char *data, size_t length, double *dPtr);
+static int TxnStep(LiteHandle *ltHandle, int txn);
+static CONST char *ConfigPrewarm(CONST char *path);
+static void Prewarm(LiteHandle *ltHandle);
+static int EmptyTail(CONST char *tail, CONST char *end);
+static void NormalizeSql(Ns_DString *dsPtr, CONST char *sql, int length);
+static void GetCell(LiteHandle *ltHandle, sqlite3_stmt *st, unsigned int index);
+static size_t FormatInt(char *buf, sqlite3_int64 value);
+static Tcl_Obj *ColumnObj(sqlite3_stmt *st, int col);
+
+static CONST char *ConfigPragmas(CONST char *path);
+static void ConfigPragma(Ns_DString *dsPtr, CONST char *path, CONST char *key,
+                         CONST char *CONST *choices);
+static int ConfigureConn(LiteHandle *ltHandle, Ns_DString *dsPtr);
+static Ns_SchedProc CheckpointProc;
+static Ns_SchedProc MaintenanceProc;
+static int Optimize(LiteHandle *ltHandle);
+static int PragmaInt(LiteHandle *ltHandle, CONST char *sql, int *valuePtr);
+static int TraceProfile(unsigned int UNUSED(mask), void *arg, void *p, void *x);
+static int PragmaResult(void *arg, int numCols, char **values, char **names);
+
+static int ConfigChoice(CONST char *path, CONST char *key,
+                        CONST char *CONST *choices, int defChoice);
+static int ConfigBusyMode(CONST char *path);
+static int BusyHandler(void *arg, int count);
+static void BusyDone(LiteHandle *ltHandle, Ns_Time *waitPtr);
+#ifdef SQLITE_ENABLE_SNAPSHOT
+static Tcl_ObjCmdProc SnapshotObjCmd;
+static Tcl_ObjCmdProc SnapshotFreeObjCmd;
+static Tcl_ObjCmdProc WithSnapshotObjCmd;
+static int OpenSnapshot(LiteHandle *ltHandle, LiteSnapshot *snapPtr);
+static void ReleaseSnapshot(LiteSnapshot *snapPtr);
+#endif
+
+#ifdef SQLITE_ENABLE_UNLOCK_NOTIFY
+static int WaitForUnlockNotify(LiteHandle *ltHandle);
+static void UnlockNotify(void **args, int numArgs);
+#endif
+
+static void ConfigProcess(CONST char *path);
+static void ConfigHeapLimits(CONST char *path);
+static int ConfigOpenFlags(CONST char *path);
+static void ConfigShards(LiteConfig *ltCfg, CONST char *path);
+static void ConfigExtensions(LiteConfig *ltCfg, CONST char *path);
+static CONST char **ConfigList(CONST char *path, CONST char *key, int *numPtr);
+static void Warm(LiteConfig *ltCfg, CONST char *path);
+static Ns_ThreadProc WarmThread;
+static void WarmPages(LiteHandle *ltHandle);
+static int LoadExtensions(LiteHandle *ltHandle, Ns_DString *dsPtr);
+static void RegexpFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void LevenshteinFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void FreeObj(void *arg);
+static int Authorizer(void *arg, int action, const char *arg1,
+                      const char *arg2, const char *schema, const char *trigger);
+static void *MemMalloc(int size);
+static void MemFree(void *ptr);
+static void *MemRealloc(void *ptr, int size);
+static int MemSize(void *ptr);
+static int MemRoundup(int size);
+static int MemInit(void *arg);
+static void MemShutdown(void *arg);
+static CONST char *ConfigDatasource(CONST char *path, CONST char *module);
+static void AppendUriPath(Ns_DString *dsPtr, CONST char *path);
+static LiteFile *GetFile(CONST char *datasource);
+static int WriteLock(LiteHandle *ltHandle, int mode, unsigned int mask);
+static void WriteUnlock(LiteHandle *ltHandle, int mode);
+static LiteFile *SchemaFile(LiteConfig *ltCfg, int schema);
+
+static void RegisterPool(LiteConfig *ltCfg);
+static Ns_TclTraceProc InitInterp;
+static LiteConfig *GetPool(Tcl_Interp *interp, CONST char *server,
+                           CONST char *pool);
+static LiteHandle *GetAux(Tcl_Interp *interp, LiteConfig *ltCfg);
+static void PutAux(LiteHandle *ltHandle);
+static int ObjToValues(Tcl_Interp *interp, Tcl_Obj *listObj,
+                       unsigned int numVars, Dbi_Value *values);
+static Tcl_ObjCmdProc DmlManyObjCmd;
+static Tcl_ObjCmdProc ScriptObjCmd;
+static Tcl_ObjCmdProc StatsObjCmd;
+static Tcl_ObjCmdProc WithTimeoutObjCmd;
+static Tcl_ObjCmdProc InterruptObjCmd;
+static Tcl_ObjCmdProc ShardObjCmd;
+static Tcl_ObjCmdProc RowsObjCmd;
+static Tcl_ObjCmdProc ExportObjCmd;
+static void ExportCell(Ns_DString *dsPtr, sqlite3_stmt *st, int col, int format);
+static void ExportString(Ns_DString *dsPtr, CONST char *string, int length, int format);
+static void AppendBase64(Ns_DString *dsPtr, CONST unsigned char *data, int length);
+static int ExportFlush(Tcl_Interp *interp, Ns_Conn *conn, Tcl_Channel chan,
+                       Ns_DString *dsPtr);
+static Tcl_ObjCmdProc BlobReadObjCmd;
+static Tcl_ObjCmdProc BlobWriteObjCmd;
+static Tcl_Obj *StatsObj(LiteStats *statsPtr, int numHandles);
+static void SumStats(LiteConfig *ltCfg, LiteStats *statsPtr, int *numPtr);
+static void AddStats(LiteStats *dstPtr, LiteStats *srcPtr);
+
+static void CacheInit(LiteConfig *ltCfg, CONST char *path);
+static int CacheLookup(LiteHandle *ltHandle, sqlite3_stmt *st,
+                       Dbi_Value *values, unsigned int numValues);
+static void CacheRow(LiteHandle *ltHandle);
+static void CacheStore(LiteHandle *ltHandle);
+static void CacheRelease(LiteHandle *ltHandle);
+static unsigned long CacheGeneration(LiteHandle *ltHandle);
+static unsigned int CacheVersion(LiteHandle *ltHandle);
+static void CacheUnlink(LiteCache *cache, LiteResult *resPtr);
+
+static void QueueInit(LiteConfig *ltCfg, CONST char *path);
+static int QueueWrite(LiteHandle *ltHandle, Dbi_Statement *stmt,
+                      Dbi_Value *values, unsigned int numValues);
+static Ns_ThreadProc QueueThread;
+static void QueueBatch(LiteQueue *queue, LiteWrite *writePtr);
+static Ns_ShutdownProc QueueShutdown;
+
+static void ReplicaInit(LiteConfig *ltCfg, CONST char *path);
+static Ns_ThreadProc ReplicaThread;
+static int ReplicaWrite(LiteReplica *replica);
+static unsigned int DataVersion(sqlite3 *conn);
+static Ns_ShutdownProc ReplicaShutdown;
+static int Backup(sqlite3 *dst, sqlite3 *src, int pages);
 
 
 /*
  * Static variables defined in this file.
  */
 
+static CONST char *CONST journalModes[] = {
+    "delete", "truncate", "persist", "memory", "wal", "off", NULL
+};
+static CONST char *CONST syncModes[] = {
+    "off", "normal", "full", "extra", "0", "1", "2", "3", NULL
+};
+static CONST char *CONST tempStores[] = {
+    "default", "file", "memory", "0", "1", "2", NULL
+};
+static CONST char *CONST vacuumModes[] = {
+    "none", "full", "incremental", "0", "1", "2", NULL
+};
+static CONST char *CONST busyModes[] = {
+    "timeout", "backoff", "notify", NULL
+};
+static CONST char *CONST bindModes[] = {
+    "text", "integer", "numeric", NULL
+};
+
+static struct {
+    CONST char  *name;
+    int          flag;
+} openFlags[] = {
+    {"nomutex",      SQLITE_OPEN_NOMUTEX},
+    {"fullmutex",    SQLITE_OPEN_FULLMUTEX},
+    {"readonly",     SQLITE_OPEN_READONLY},
+    {"uri",          SQLITE_OPEN_URI},
+    {"nofollow",     SQLITE_OPEN_NOFOLLOW},
+    {"sharedcache",  SQLITE_OPEN_SHAREDCACHE},
+    {"privatecache", SQLITE_OPEN_PRIVATECACHE},
+    {NULL, 0}
+};
+
+/*
+ * Transaction control statements by LITE_TXN_* index. Nested
+ * transactions all use the same savepoint name as release and
+ * rollback to act on the most recent savepoint of that name.
+ */
+
+static CONST char *CONST txnSql[LITE_TXN_NUM] = {
+    "begin",
+    "begin immediate",
+    "begin exclusive",
+    "commit",
+    "rollback",
+    "savepoint dbilite",
+    "release dbilite",
+    "rollback to dbilite"
+};
+
+/*
+ * Sleep schedule in msec for LITE_BUSY_TIMEOUT, as used by
+ * sqlite3_busy_timeout().
+ */
+
+static CONST int busyDelays[] = {
+    1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100
+};
+#define NUM_BUSY_DELAYS ((int)(sizeof(busyDelays) / sizeof(busyDelays[0])))
+
+/*
+ * Write locks by datasource, shared by all pools.
+ */
+
+static Tcl_HashTable files;
+static Ns_Mutex      filesLock;
+
+/*
+ * All pools by module name, for the driver commands.
+ */
+
+static Tcl_HashTable pools;
+static Tcl_HashTable servers;
+static Ns_Mutex      poolsLock;
+
+static CONST Tcl_ObjType *byteArrayTypePtr;
+
+/*
+ * Statement timeout set by dbilite::with_timeout for the thread,
+ * plus one, or NULL.
+ */
+
+static Ns_Tls timeoutTls;
+
+#ifdef SQLITE_ENABLE_SNAPSHOT
+
+/*
+ * Snapshots of dbilite::snapshot by token.
+ */
+
+static Tcl_HashTable snapshots;
+static Ns_Mutex      snapshotsLock;
+
+/*
+ * Snapshot set by dbilite::with_snapshot for the thread, or NULL.
+ */
+
+static Ns_Tls snapshotTls;
+
+#endif
+
+/*
+ * Counters reported by dbilite::stats.
+ */
+
+static struct {
+    CONST char  *name;
+    CONST char  *help;
+    size_t       offset;
+} counters[] = {
+    {"steps",        "Calls to sqlite3_step",         offsetof(LiteStats, steps)},
+    {"rows",         "Rows returned",                 offsetof(LiteStats, rows)},
+    {"busy",         "Steps which waited for a lock", offsetof(LiteStats, busy)},
+    {"prepares",     "Statements compiled",           offsetof(LiteStats, prepares)},
+    {"reuses",       "Statements reused from cache",  offsetof(LiteStats, reuses)},
+    {"finalizes",    "Statements finalized",          offsetof(LiteStats, finalizes)},
+    {"transactions", "Transactions begun",            offsetof(LiteStats, transactions)},
+    {"errors",       "Errors reported",               offsetof(LiteStats, errors)},
+    {"slow",         "Statements over slowquerytime", offsetof(LiteStats, slow)},
+    {"timeouts",     "Statements timed out",          offsetof(LiteStats, timeouts)},
+    {"interrupts",   "Statements interrupted",        offsetof(LiteStats, interrupts)},
+    {"checkpoints",  "WAL checkpoints run",           offsetof(LiteStats, checkpoints)},
+    {"optimizes",    "PRAGMA optimize runs",          offsetof(LiteStats, optimizes)},
+    {"vacuumed",     "Free pages vacuumed",           offsetof(LiteStats, vacuumed)},
+    {"cachehits",    "Queries answered from cache",   offsetof(LiteStats, cacheHits)},
+    {"cachemisses",  "Cacheable queries run",         offsetof(LiteStats, cacheMisses)},
+    {NULL, NULL, 0u}
+};
+#define COUNTER(statsPtr, i) \
+    (*(Tcl_WideInt *)((char *)(statsPtr) + counters[(i)].offset))
+
+static struct {
+    CONST char  *name;
+    CONST char  *metric;
+    CONST char  *help;
+    size_t       offset;
+} times[] = {
+    {"busywait",       "busy_wait",  "Time waiting for sqlite locks",
+     offsetof(LiteStats, busyWait)},
+    {"lockwait",       "lock_wait",  "Time waiting for the write lock",
+     offsetof(LiteStats, lockWait)},
+    {"checkpointtime", "checkpoint", "Time running WAL checkpoints",
+     offsetof(LiteStats, checkpointTime)},
+    {"maintenancetime", "maintenance", "Time running optimize and vacuum",
+     offsetof(LiteStats, maintenanceTime)},
+    {NULL, NULL, NULL, 0u}
+};
+#define TIME(statsPtr, i) \
+    ((Ns_Time *)((char *)(statsPtr) + times[(i)].offset))
+
+static struct {
+    CONST char  *name;
+    CONST char  *metric;
+    CONST char  *help;
+    int          op;
+} memory[LITE_MEM_NUM] = {
+    {"cacheused",     "cache_used_bytes",     "Page cache memory",
+     SQLITE_DBSTATUS_CACHE_USED},
+    {"schemaused",    "schema_used_bytes",    "Schema memory",
+     SQLITE_DBSTATUS_SCHEMA_USED},
+    {"stmtused",      "stmt_used_bytes",      "Prepared statement memory",
+     SQLITE_DBSTATUS_STMT_USED},
+    {"lookasideused", "lookaside_used_slots", "Lookaside slots in use",
+     SQLITE_DBSTATUS_LOOKASIDE_USED}
+};
+
+/*
+ * Commands created in every interp of a server with a dbilite pool.
+ */
+
+static struct {
+    CONST char      *name;
+    Tcl_ObjCmdProc  *proc;
+} cmds[] = {
+    {"dbilite::dml_many", DmlManyObjCmd},
+    {"dbilite::script",   ScriptObjCmd},
+    {"dbilite::rows",     RowsObjCmd},
+    {"dbilite::export",   ExportObjCmd},
+    {"dbilite::stats",    StatsObjCmd},
+    {"dbilite::with_timeout", WithTimeoutObjCmd},
+    {"dbilite::interrupt",    InterruptObjCmd},
+    {"dbilite::shard",        ShardObjCmd},
+#ifdef SQLITE_ENABLE_SNAPSHOT
+    {"dbilite::snapshot",      SnapshotObjCmd},
+    {"dbilite::snapshot_free", SnapshotFreeObjCmd},
+    {"dbilite::with_snapshot", WithSnapshotObjCmd},
+#endif
+    {"dbilite::blob_read",  BlobReadObjCmd},
+    {"dbilite::blob_write", BlobWriteObjCmd},
+    {NULL, NULL}
+};
+
 static Dbi_DriverProc procs[] = {
     {Dbi_OpenProcId,         (Ns_Callback *)Open},
     {Dbi_CloseProcId,        (Ns_Callback *)Close},
@@ -126,15 +761,95 @@ Ns_ModuleInit(CONST char *server, CONST char *module)
     const char *path;
     CONST char *drivername = "sqlite";
     CONST char *database   = "sqlite3";
+    int         i;
 
     Dbi_LibInit();
 
     path = Ns_ConfigGetPath(server, module, NULL);
+    ConfigProcess(path);
 
     ltCfg = ns_calloc(1, sizeof(LiteConfig));
     ltCfg->module     = ns_strdup(module);
-    ltCfg->datasource = Ns_ConfigString(path, "datasource", ":memory:");
+    ltCfg->server     = server != NULL ? ns_strdup(server) : NULL;
+    ltCfg->isDefault  = Ns_ConfigBool(path, "default", NS_FALSE);
+    ltCfg->immutable  = Ns_ConfigBool(path, "immutable", NS_FALSE);
+    ltCfg->datasource = ConfigDatasource(path, module);
     ltCfg->retries    = Ns_ConfigIntRange(path, "sqlitebusyretries", 100, 0, INT_MAX);
+    ltCfg->busyMode   = ConfigBusyMode(path);
+    ltCfg->busyTimeout = Ns_ConfigIntRange(path, "busytimeout", 5000, 0, INT_MAX);
+    ltCfg->maxHandles = Ns_ConfigIntRange(path, "maxhandles", 0, 0, INT_MAX);
+    ltCfg->backoffMin = Ns_ConfigIntRange(path, "busybackoffmin", 1, 1, INT_MAX);
+    ltCfg->backoffMax = Ns_ConfigIntRange(path, "busybackoffmax", 100,
+                                          ltCfg->backoffMin, INT_MAX);
+    ltCfg->pragmas    = ConfigPragmas(path);
+    ltCfg->journal    = Ns_ConfigGetValue(path, "journal_mode");
+    ltCfg->bindMode   = ConfigChoice(path, "bindtypes", bindModes, LITE_BIND_TEXT);
+    ltCfg->prewarm    = ConfigPrewarm(path);
+    ltCfg->slowTime   = Ns_ConfigIntRange(path, "slowquerytime", 0, 0, INT_MAX);
+    ltCfg->stmtTimeout = Ns_ConfigIntRange(path, "statementtimeout", 0, 0, INT_MAX);
+    ltCfg->idleMemory = Ns_ConfigIntRange(path, "idlememory", -1, -1, INT_MAX);
+    ltCfg->lookasideSize = Ns_ConfigIntRange(path, "lookasidesize", 0, 0, 65536);
+    ltCfg->lookasideCount = Ns_ConfigIntRange(path, "lookasidecount", 0, 0, INT_MAX);
+    ConfigHeapLimits(path);
+
+    ltCfg->openFlags  = ConfigOpenFlags(path);
+    ConfigShards(ltCfg, path);
+    CacheInit(ltCfg, path);
+    ConfigExtensions(ltCfg, path);
+    ltCfg->functions  = Ns_ConfigBool(path, "functions", NS_TRUE);
+
+    if (!(ltCfg->openFlags & SQLITE_OPEN_READONLY)) {
+        if (Ns_ConfigBool(path, "serializewrites", NS_FALSE)) {
+            ltCfg->file = GetFile(ltCfg->datasource);
+            if (ltCfg->file != NULL && ltCfg->numShards > 0) {
+                ltCfg->shardFiles = ns_calloc((size_t) ltCfg->numShards,
+                                              sizeof(LiteFile *));
+                for (i = 0; i < ltCfg->numShards; i++) {
+                    ltCfg->shardFiles[i] = GetFile(ltCfg->shardPaths[i]);
+                }
+            }
+        }
+        if (Ns_ConfigBool(path, "groupcommit", NS_FALSE)) {
+            QueueInit(ltCfg, path);
+        }
+        ltCfg->checkpointInterval =
+            Ns_ConfigIntRange(path, "checkpointinterval", 0, 0, INT_MAX);
+        ltCfg->checkpointLimit =
+            Ns_ConfigIntRange(path, "checkpointlimit", 10000, 1, INT_MAX);
+        if (ltCfg->checkpointInterval > 0) {
+            (void) Ns_ScheduleProc(CheckpointProc, ltCfg, 1,
+                                   ltCfg->checkpointInterval);
+        }
+        ltCfg->optimize = Ns_ConfigBool(path, "optimize", NS_FALSE);
+        ltCfg->maintenanceInterval =
+            Ns_ConfigIntRange(path, "maintenanceinterval", 0, 0, INT_MAX);
+        ltCfg->maintenanceTime =
+            Ns_ConfigIntRange(path, "maintenancetime", 100, 1, INT_MAX);
+        ltCfg->vacuumPages =
+            Ns_ConfigIntRange(path, "vacuumpages", 0, 0, INT_MAX);
+        if (ltCfg->maintenanceInterval > 0) {
+            (void) Ns_ScheduleProc(MaintenanceProc, ltCfg, 1,
+                                   ltCfg->maintenanceInterval);
+        }
+    }
+
+    if ((Ns_ConfigBool(path, "sharedmemory", NS_FALSE)
+         || Ns_ConfigBool(path, "replica", NS_FALSE))
+            && sqlite3_open_v2(ltCfg->datasource, &ltCfg->keeper,
+                               SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+                               | SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
+        Ns_Log(Error, "dbilite: %s: could not create shared memory db: %s",
+               module, sqlite3_errmsg(ltCfg->keeper));
+        (void) sqlite3_close(ltCfg->keeper);
+        ltCfg->keeper = NULL;
+    }
+    if (ltCfg->keeper != NULL && Ns_ConfigBool(path, "replica", NS_FALSE)) {
+        ReplicaInit(ltCfg, path);
+    }
+    Ns_MutexInit(&ltCfg->lock);
+    Ns_MutexSetName2(&ltCfg->lock, "dbilite", module);
+    Warm(ltCfg, path);
+    RegisterPool(ltCfg);
 
     return Dbi_RegisterDriver(server, module,
                               drivername, database,
@@ -153,7 +868,9 @@ Ns_ModuleInit(CONST char *server, CONST char *module)
  *      NS_OK / NS_ERROR.
  *
  * Side effects:
- *      None.
+ *      Configured busy handler and pragmas are applied to the new
+ *      connection, and configured statements are prepared, unless
+ *      done at startup.
  *
  *----------------------------------------------------------------------
  */
@@ -163,16 +880,37 @@ Open(ClientData configData, Dbi_Handle *handle)
 {
     LiteConfig *ltCfg = configData;
     LiteHandle *ltHandle;
-    sqlite3    *conn;
+    Ns_DString  ds;
 
-    if (sqlite3_open(ltCfg->datasource, &conn) != SQLITE_OK) {
-        Dbi_SetException(handle, "SQLIT", "%s", sqlite3_errmsg(conn));
-        (void) sqlite3_close(conn);
-        return NS_ERROR;
+    /*
+     * Take a connection opened and warmed at startup, if any left.
+     */
+
+    Ns_MutexLock(&ltCfg->lock);
+    ltHandle = ltCfg->sparePtr;
+    if (ltHandle != NULL) {
+        ltCfg->sparePtr = ltHandle->nextPtr;
+        ltHandle->nextPtr = NULL;
+    }
+    ltCfg->numOpen++;
+    Ns_MutexUnlock(&ltCfg->lock);
+
+    if (ltHandle == NULL) {
+        Ns_DStringInit(&ds);
+        ltHandle = NewHandle(ltCfg, &ds);
+        if (ltHandle == NULL) {
+            Dbi_SetException(handle, "SQLIT", "%s", Ns_DStringValue(&ds));
+            Ns_DStringFree(&ds);
+            Ns_MutexLock(&ltCfg->lock);
+            ltCfg->numOpen--;
+            Ns_MutexUnlock(&ltCfg->lock);
+            return NS_ERROR;
+        }
+        Ns_DStringFree(&ds);
+        if (ltCfg->prewarm != NULL) {
+            Prewarm(ltHandle);
+        }
     }
-    ltHandle = ns_calloc(1, sizeof(LiteHandle));
-    ltHandle->ltCfg = ltCfg;
-    ltHandle->conn = conn;
     ltHandle->handle = handle;
     handle->driverData = ltHandle;
 
@@ -200,14 +938,18 @@ static void
 Close(Dbi_Handle *handle)
 {
     LiteHandle *ltHandle = handle->driverData;
+    LiteConfig *ltCfg;
 
     assert(ltHandle);
 
-    if (sqlite3_close(ltHandle->conn) != SQLITE_OK) {
-        Ns_Log(Error, "dbilite: error closing db handle: %s",
-               sqlite3_errmsg(ltHandle->conn));
+    ltCfg = ltHandle->ltCfg;
+    if (ltCfg->optimize) {
+        (void) Optimize(ltHandle);
     }
-    ns_free(ltHandle);
+    FreeHandle(ltHandle);
+    Ns_MutexLock(&ltCfg->lock);
+    ltCfg->numOpen--;
+    Ns_MutexUnlock(&ltCfg->lock);
     handle->driverData = NULL;
 }
 
@@ -269,7 +1011,8 @@ Bind(Ns_DString *ds, const char *UNUSED(name), int UNUSED(bindIdx))
  *
  * Prepare --
  *
- *      Prepare a statement if one doesn't already exist for this query..
+ *      Prepare a statement if one doesn't already exist for this query,
+ *      taking it from the prewarmed statements if there.
  *
  * Results:
  *      NS_OK or NS_ERROR.
@@ -284,19 +1027,58 @@ static int
 Prepare(Dbi_Handle *handle, Dbi_Statement *stmt,
         unsigned int *numVarsPtr, unsigned int *numColsPtr)
 {
-    LiteHandle   *ltHandle = handle->driverData;
-    sqlite3_stmt *st;
-    const char   *tail;
+    LiteHandle    *ltHandle = handle->driverData;
+    sqlite3_stmt  *st = NULL;
+    const char    *tail;
+    Tcl_HashEntry *hPtr = NULL;
+    Ns_DString     ds;
+    int            isNew;
 
     if (stmt->driverData == NULL) {
-        if (sqlite3_prepare_v2(ltHandle->conn, stmt->sql, stmt->length, &st, &tail)
-                != SQLITE_OK) {
+        if (ltHandle->warm.numEntries > 0) {
+            Ns_DStringInit(&ds);
+            NormalizeSql(&ds, stmt->sql, stmt->length);
+            hPtr = Tcl_FindHashEntry(&ltHandle->warm, Ns_DStringValue(&ds));
+            if (hPtr != NULL) {
+                st = Tcl_GetHashValue(hPtr);
+                Tcl_DeleteHashEntry(hPtr);
+                ltHandle->stats.reuses++;
+            }
+            Ns_DStringFree(&ds);
+        }
+        /*
+         * NB: Statements are cached by nsdbi for the life of the handle.
+         */
+        ltHandle->authMask = 0u;
+        ltHandle->authVolatile = 0;
+        if (st == NULL
+                && sqlite3_prepare_v3(ltHandle->conn, stmt->sql, stmt->length,
+                                      SQLITE_PREPARE_PERSISTENT, &st, &tail)
+                   != SQLITE_OK) {
             ReportException(ltHandle);
             return NS_ERROR;
         }
+        if (hPtr == NULL) {
+            ltHandle->stats.prepares++;
+            if (!EmptyTail(tail, stmt->sql + stmt->length)) {
+                (void) sqlite3_finalize(st);
+                Dbi_SetException(handle, "SQLIT", "dbilite: query contains"
+                                 " more than one statement, use dbilite::script");
+                return NS_ERROR;
+            }
+            if (ltHandle->ltCfg->shardFiles != NULL) {
+                hPtr = Tcl_CreateHashEntry(&ltHandle->masks, (char *) st, &isNew);
+                Tcl_SetHashValue(hPtr, INT2PTR((int) ltHandle->authMask));
+            }
+            if (ltHandle->authVolatile) {
+                (void) Tcl_CreateHashEntry(&ltHandle->uncached, (char *) st, &isNew);
+            }
+        }
         *numVarsPtr = (unsigned int)sqlite3_bind_parameter_count(st);
         *numColsPtr = (unsigned int)sqlite3_column_count(st);
         stmt->driverData = st;
+    } else {
+        ltHandle->stats.reuses++;
     }
 
     return NS_OK;
@@ -322,11 +1104,24 @@ Prepare(Dbi_Handle *handle, Dbi_Statement *stmt,
 static void
 PrepareClose(Dbi_Handle *handle, Dbi_Statement *stmt)
 {
-    LiteHandle   *ltHandle = handle->driverData;
-    sqlite3_stmt *st = stmt->driverData;
+    LiteHandle    *ltHandle = handle->driverData;
+    sqlite3_stmt  *st = stmt->driverData;
+    Tcl_HashEntry *hPtr;
 
     assert(st);
 
+    if (ltHandle->hitStmt == st || ltHandle->fillStmt == st) {
+        CacheRelease(ltHandle);
+    }
+    hPtr = Tcl_FindHashEntry(&ltHandle->masks, (char *) st);
+    if (hPtr != NULL) {
+        Tcl_DeleteHashEntry(hPtr);
+    }
+    hPtr = Tcl_FindHashEntry(&ltHandle->uncached, (char *) st);
+    if (hPtr != NULL) {
+        Tcl_DeleteHashEntry(hPtr);
+    }
+    ltHandle->stats.finalizes++;
     if (sqlite3_finalize(st) != SQLITE_OK) {
         ReportException(ltHandle);
     }
@@ -345,7 +1140,8 @@ PrepareClose(Dbi_Handle *handle, Dbi_Statement *stmt)
  *      NS_OK or NS_ERROR.
  *
  * Side effects:
- *      The state machine is run for DML statements.
+ *      The state machine is run for DML statements, possibly by the
+ *      group commit writer thread.
  *
  *----------------------------------------------------------------------
  */
@@ -354,29 +1150,52 @@ static int
 Exec(Dbi_Handle *handle, Dbi_Statement *stmt,
      Dbi_Value *values, unsigned int numValues)
 {
-    LiteHandle   *ltHandle = handle->driverData;
-    sqlite3_stmt *st = stmt->driverData;
-    int           rc;
-    unsigned int  i;
+    LiteHandle    *ltHandle = handle->driverData;
+    sqlite3_stmt  *st = stmt->driverData;
+    Tcl_HashEntry *hPtr;
+    int            rc;
 
     assert(st);
 
     /*
-     * NB: sqlite indexes variables from 1, nsdbi from 0.
+     * DML outside of a transaction may be handed to the group commit
+     * writer rather than run here.
      */
 
-    for (i = 0u; i < numValues; i++) {
-        if (values[i].data == NULL) {
-            rc = sqlite3_bind_null(st, (int)i+1);
-        } else if (values[i].binary) {
-            rc = sqlite3_bind_blob(st, (int)i+1, values[i].data, (int)values[i].length,
-                                   SQLITE_STATIC);
-        } else {
-            rc = sqlite3_bind_text(st, (int)i+1, values[i].data, (int)values[i].length,
-                                   SQLITE_STATIC);
-        }
-        if (rc != SQLITE_OK) {
-            ReportException(ltHandle);
+    if (ltHandle->ltCfg->queue != NULL
+            && Dbi_NumColumns(handle) == 0
+            && !sqlite3_stmt_readonly(st)
+            && sqlite3_get_autocommit(ltHandle->conn)) {
+        return QueueWrite(ltHandle, stmt, values, numValues);
+    }
+
+    StartStatement(ltHandle);
+
+    if (ltHandle->ltCfg->cache != NULL
+            && Dbi_NumColumns(handle) > 0
+            && CacheLookup(ltHandle, st, values, numValues)) {
+        return NS_OK;
+    }
+
+    if (BindValues(st, values, numValues, ltHandle->ltCfg->bindMode) != SQLITE_OK) {
+        ReportException(ltHandle);
+        return NS_ERROR;
+    }
+
+    /*
+     * Writes outside of a transaction take the write lock for the
+     * duration of the statement, of only those shards it writes.
+     */
+
+    if (ltHandle->ltCfg->file != NULL
+            && ltHandle->writeLock == LITE_LOCK_NONE
+            && !sqlite3_stmt_readonly(st)) {
+        hPtr = Tcl_FindHashEntry(&ltHandle->masks, (char *) st);
+        if (WriteLock(ltHandle, LITE_LOCK_STMT, hPtr != NULL
+                      ? (unsigned int) PTR2INT(Tcl_GetHashValue(hPtr))
+                      : LITE_SCHEMA_ALL) != NS_OK) {
+            ltHandle->running = 0;
+            LockException(ltHandle);
             return NS_ERROR;
         }
     }
@@ -391,6 +1210,8 @@ Exec(Dbi_Handle *handle, Dbi_Statement *stmt,
      */
 
     rc = Step(handle, stmt);
+    WriteUnlock(ltHandle, LITE_LOCK_STMT);
+    ltHandle->running = 0;
 
     if (rc == SQLITE_ROW) {
         Dbi_SetException(handle, "SQLIT",
@@ -421,18 +1242,41 @@ Exec(Dbi_Handle *handle, Dbi_Statement *stmt,
 static int
 NextRow(Dbi_Handle *handle, Dbi_Statement *stmt, int *endPtr)
 {
-    int  status;
+    LiteHandle *ltHandle = handle->driverData;
+    int         status;
+
+    ltHandle->cellStmt = NULL;
+
+    if (ltHandle->hitPtr != NULL && ltHandle->hitStmt == stmt->driverData) {
+        if (++ltHandle->hitRow >= ltHandle->hitPtr->numRows) {
+            *endPtr = 1;
+            CacheRelease(ltHandle);
+        }
+        return NS_OK;
+    }
 
     switch (Step(handle, stmt)) {
     case SQLITE_ROW:
         status = NS_OK;
+        if (ltHandle->fillStmt == stmt->driverData) {
+            CacheRow(ltHandle);
+        }
         break;
     case SQLITE_DONE:
         *endPtr = 1;
         status = NS_OK;
+        WriteUnlock(ltHandle, LITE_LOCK_STMT);
+        ltHandle->running = 0;
+        if (ltHandle->fillStmt == stmt->driverData) {
+            CacheStore(ltHandle);
+        }
         break;
     case SQLITE_ERROR:
+    default:
         status = NS_ERROR;
+        WriteUnlock(ltHandle, LITE_LOCK_STMT);
+        ltHandle->running = 0;
+        CacheRelease(ltHandle);
         break;
     }
 
@@ -452,19 +1296,20 @@ NextRow(Dbi_Handle *handle, Dbi_Statement *stmt, int *endPtr)
  *      NS_OK;
  *
  * Side effects:
- *      None.
+ *      The cell is cached for the following ColumnValue().
  *
  *----------------------------------------------------------------------
  */
 
 static int
-ColumnLength(Dbi_Handle *UNUSED(handle), Dbi_Statement *stmt, unsigned int index,
+ColumnLength(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
              size_t *lengthPtr, int *binaryPtr)
 {
-    sqlite3_stmt *st = stmt->driverData;
+    LiteHandle *ltHandle = handle->driverData;
 
-    *lengthPtr = (size_t)sqlite3_column_bytes(st, (int) index);
-    *binaryPtr = (sqlite3_column_type(st, (int) index) == SQLITE_BLOB);
+    GetCell(ltHandle, stmt->driverData, index);
+    *lengthPtr = ltHandle->cellLength;
+    *binaryPtr = ltHandle->cellBinary;
 
     return NS_OK;
 }
@@ -487,18 +1332,18 @@ ColumnLength(Dbi_Handle *UNUSED(handle), Dbi_Statement *stmt, unsigned int index
  */
 
 static int
-ColumnValue(Dbi_Handle *UNUSED(handle), Dbi_Statement *stmt, unsigned int index,
+ColumnValue(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
             char *value, size_t length)
 {
+    LiteHandle   *ltHandle = handle->driverData;
     sqlite3_stmt *st = stmt->driverData;
-    const char   *src;
 
-    if (sqlite3_column_type(st, (int) index) == SQLITE_BLOB) {
-        src = sqlite3_column_blob(st, (int) index);
-    } else {
-        src = (const char *) sqlite3_column_text(st, (int) index);
+    if (ltHandle->cellStmt != st || ltHandle->cellIndex != index) {
+        GetCell(ltHandle, st, index);
+    }
+    if (ltHandle->cellLength > 0u) {
+        memcpy(value, ltHandle->cellData, MIN(length, ltHandle->cellLength));
     }
-    memcpy(value, src, MIN((int)length, sqlite3_column_bytes(st, (int) index)));
 
     return NS_OK;
 }
@@ -539,7 +1384,8 @@ ColumnName(Dbi_Handle *UNUSED(handle), Dbi_Statement *stmt,
  *
  * Transaction --
  *
- *      Begin, commit and rollback transactions.
+ *      Begin, commit and rollback transactions. Nested transactions
+ *      map to savepoints.
  *
  * Results:
  *      NS_OK or NS_ERROR
@@ -555,39 +1401,84 @@ Transaction(Dbi_Handle *handle, unsigned int depth,
             Dbi_TransactionCmd cmd, Dbi_Isolation isolation)
 {
     LiteHandle   *ltHandle = handle->driverData;
-    sqlite3_stmt *st;
-    CONST char   *sql;
-    int           status;
+    int           status = SQLITE_ERROR;
+#ifdef SQLITE_ENABLE_SNAPSHOT
+    LiteSnapshot *snapPtr;
+#endif
 
-    if (depth) {
-        Dbi_SetException(handle, "SQLIT",
-            "dbilite does not support nested transactions");
-        return NS_ERROR;
+    /*
+     * Nothing can change an immutable database, so every query is
+     * as good as serializable already.
+     */
+
+    if (ltHandle->ltCfg->immutable) {
+        return NS_OK;
     }
 
     switch(cmd) {
     case Dbi_TransactionBegin:
-        sql = (isolation == Dbi_Serializable)
-            ? "begin exclusive" : "begin";
+        if (depth > 0) {
+            status = TxnStep(ltHandle, LITE_TXN_SAVEPOINT);
+            break;
+        }
+#ifdef SQLITE_ENABLE_SNAPSHOT
+        /*
+         * Within dbilite::with_snapshot, transactions read at the
+         * snapshot and so are deferred, without the write lock.
+         */
+
+        if ((snapPtr = Ns_TlsGet(&snapshotTls)) != NULL) {
+            status = TxnStep(ltHandle, LITE_TXN_BEGIN);
+            if (status == SQLITE_OK) {
+                return OpenSnapshot(ltHandle, snapPtr);
+            }
+            break;
+        }
+#endif
+        if (ltHandle->ltCfg->file != NULL
+                && WriteLock(ltHandle, LITE_LOCK_TXN, LITE_SCHEMA_ALL) != NS_OK) {
+            LockException(ltHandle);
+            return NS_ERROR;
+        }
+        if (isolation == Dbi_Serializable) {
+            status = TxnStep(ltHandle, LITE_TXN_BEGIN_EXCLUSIVE);
+        } else if (ltHandle->ltCfg->file != NULL) {
+            status = TxnStep(ltHandle, LITE_TXN_BEGIN_IMMEDIATE);
+        } else {
+            status = TxnStep(ltHandle, LITE_TXN_BEGIN);
+        }
         break;
     case Dbi_TransactionCommit:
-        sql = "commit";
+        status = TxnStep(ltHandle, depth > 0
+                         ? LITE_TXN_RELEASE : LITE_TXN_COMMIT);
         break;
     case Dbi_TransactionRollback:
-        sql = "rollback";
+        if (depth > 0) {
+            /*
+             * Rolling back to a savepoint leaves it on the stack.
+             */
+            status = TxnStep(ltHandle, LITE_TXN_ROLLBACK_TO);
+            if (status == SQLITE_OK) {
+                status = TxnStep(ltHandle, LITE_TXN_RELEASE);
+            }
+        } else {
+            status = TxnStep(ltHandle, LITE_TXN_ROLLBACK);
+        }
         break;
     default:
         Ns_Fatal("dbilite: Transaction: unhandled cmd: %d", (int) cmd);
     }
 
-    status = NS_OK;
-
-    if (sqlite3_prepare(ltHandle->conn, sql, -1, &st, NULL) != SQLITE_OK
-            || sqlite3_step(st) != SQLITE_DONE) {
+    if (status != SQLITE_OK) {
         ReportException(ltHandle);
         status = NS_ERROR;
+    } else {
+        status = NS_OK;
+    }
+
+    if (sqlite3_get_autocommit(ltHandle->conn)) {
+        WriteUnlock(ltHandle, LITE_LOCK_TXN);
     }
-    (void) sqlite3_finalize(st);
 
     return status;
 }
@@ -605,7 +1496,8 @@ Transaction(Dbi_Handle *handle, unsigned int depth,
  *
  * Side effects:
  *      Also clears the variable bindings as nsdbi has no way to
- *      selectively re-bind indiviual variables.
+ *      selectively re-bind indiviual variables. The write lock is
+ *      released if held for this statement only.
  *
  *----------------------------------------------------------------------
  */
@@ -618,6 +1510,13 @@ Flush(Dbi_Handle *handle, Dbi_Statement *stmt)
 
     assert(st);
 
+    ltHandle->cellStmt = NULL;
+    ltHandle->running = 0;
+    WriteUnlock(ltHandle, LITE_LOCK_STMT);
+    if (ltHandle->hitStmt == st || ltHandle->fillStmt == st) {
+        CacheRelease(ltHandle);
+    }
+
     if (sqlite3_reset(st) != SQLITE_OK) {
         ReportException(ltHandle);
         return NS_ERROR;
@@ -635,20 +1534,30 @@ Flush(Dbi_Handle *handle, Dbi_Statement *stmt)
  *
  * Reset --
  *
- *      Nothing to do?
+ *      Handle is being returned to the pool.
  *
  * Results:
  *      Always NS_OK.
  *
  * Side effects:
- *      None.
+ *      Any write lock still held is released.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-Reset(Dbi_Handle *UNUSED(handle))
+Reset(Dbi_Handle *handle)
 {
+    LiteHandle *ltHandle = handle->driverData;
+
+    if (ltHandle->writeLock != LITE_LOCK_NONE) {
+        Ns_Log(Warning, "dbilite: %s: write lock held on reset",
+               ltHandle->ltCfg->module);
+        WriteUnlock(ltHandle, ltHandle->writeLock);
+    }
+    CacheRelease(ltHandle);
+    SampleMemory(ltHandle);
+
     return NS_OK;
 }
 
@@ -664,8 +1573,8 @@ Reset(Dbi_Handle *UNUSED(handle))
  *      An sqlite result code: SQLITE_ROW, SQLITE_DONE, SQLITE_ERROR.
  *
  * Side effects:
- *      May retry the step if busy or recompile the statement on
- *      schema change.
+ *      May wait for a lock held by another connection, see
+ *      BusyHandler(), or recompile the statement on schema change.
  *
  *----------------------------------------------------------------------
  */
@@ -675,15 +1584,26 @@ Step(Dbi_Handle *handle, Dbi_Statement *stmt)
 {
     LiteHandle   *ltHandle = handle->driverData;
     sqlite3_stmt *st = stmt->driverData;
-    int           rc, retries;
+    Ns_Time       wait;
+    int           rc;
 
-    retries = ltHandle->ltCfg->retries;
+    wait.sec = wait.usec = 0;
 
-    do {
-        if ((rc = sqlite3_step(st)) == SQLITE_BUSY) {
-            Ns_ThreadYield();
+    for (;;) {
+        rc = StepStmt(ltHandle, st, &wait);
+#ifdef SQLITE_ENABLE_UNLOCK_NOTIFY
+        if (rc == SQLITE_LOCKED
+                && ltHandle->ltCfg->busyMode == LITE_BUSY_NOTIFY
+                && sqlite3_extended_errcode(ltHandle->conn)
+                   == SQLITE_LOCKED_SHAREDCACHE
+                && WaitForUnlockNotify(ltHandle) == SQLITE_OK) {
+            BusyDone(ltHandle, &wait);
+            (void) sqlite3_reset(st);
+            continue;
         }
-    } while (rc == SQLITE_BUSY && --retries > 0);
+#endif
+        break;
+    }
 
     switch (rc) {
 
@@ -693,12 +1613,29 @@ Step(Dbi_Handle *handle, Dbi_Statement *stmt)
         break;
 
     case SQLITE_BUSY:
-        Dbi_SetException(handle, "SQLIT", "dbisqlite: error executing statement: "
-            "database still busy after %d retries.", ltHandle->ltCfg->retries);
+    case SQLITE_LOCKED:
+        ltHandle->stats.errors++;
+        Dbi_SetException(handle, "SQLIT", "dbilite: error executing statement: "
+            "database still busy after waiting %ld.%03ld seconds",
+            wait.sec, wait.usec / 1000);
+        rc = SQLITE_ERROR;
+        break;
+
+    case SQLITE_INTERRUPT:
+        ltHandle->stats.errors++;
+        if (ltHandle->timedOut) {
+            ltHandle->stats.timeouts++;
+            Dbi_SetException(handle, "SQTMO", "dbilite: statement timed out"
+                             " after %d msec", ltHandle->timeout);
+        } else {
+            ltHandle->stats.interrupts++;
+            Dbi_SetException(handle, "SQINT", "dbilite: statement interrupted");
+        }
         rc = SQLITE_ERROR;
         break;
 
     case SQLITE_MISUSE:
+        ltHandle->stats.errors++;
         Dbi_SetException(handle, "SQLIT", "dbilite: Bug: SQLITE_MISUSE");
         rc = SQLITE_ERROR;
         break;
@@ -733,13 +1670,5738 @@ Step(Dbi_Handle *handle, Dbi_Statement *stmt)
 static void
 ReportException(LiteHandle *ltHandle)
 {
+    ltHandle->stats.errors++;
+
     if (sqlite3_errcode(ltHandle->conn) == SQLITE_NOMEM) {
-        Ns_Fatal("dbilite: SQLITE_NOMEM: %s",
-                 sqlite3_errmsg(ltHandle->conn));
+        Ns_Log(Error, "dbilite: %s: out of memory, sqlite is using %"
+               TCL_LL_MODIFIER "d bytes", ltHandle->ltCfg->module,
+               (Tcl_WideInt) sqlite3_memory_used());
+        (void) sqlite3_db_release_memory(ltHandle->conn);
     }
     Dbi_SetException(ltHandle->handle, "SQLIT", "%s", sqlite3_errmsg(ltHandle->conn));
 }
 
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LockException --
+ *
+ *      Set the dbi handle exception for a write lock which stayed
+ *      busy for busytimeout msec.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+LockException(LiteHandle *ltHandle)
+{
+    ltHandle->stats.errors++;
+    Dbi_SetException(ltHandle->handle, "SQLIT", "dbilite: write lock still busy"
+                     " after waiting %d msec", ltHandle->ltCfg->busyTimeout);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SampleMemory --
+ *
+ *      Release all unused page cache memory of an idle handle which
+ *      uses more than idlememory, and note what the handle uses for
+ *      dbilite::stats.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The next queries on the handle may need to read pages again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SampleMemory(LiteHandle *ltHandle)
+{
+    int i, cur, hiwtr;
+
+    if (ltHandle->ltCfg->idleMemory >= 0
+            && sqlite3_db_status(ltHandle->conn, SQLITE_DBSTATUS_CACHE_USED,
+                                 &cur, &hiwtr, 0) == SQLITE_OK
+            && cur > ltHandle->ltCfg->idleMemory * 1024) {
+        (void) sqlite3_db_release_memory(ltHandle->conn);
+    }
+    for (i = 0; i < LITE_MEM_NUM; i++) {
+        cur = 0;
+        (void) sqlite3_db_status(ltHandle->conn, memory[i].op, &cur, &hiwtr, 0);
+        ltHandle->stats.memory[i] = cur;
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StartStatement --
+ *
+ *      Note the start of a statement and arm the progress handler
+ *      if it has a timeout, from dbilite::with_timeout or the pool.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StartStatement(LiteHandle *ltHandle)
+{
+    void *override = Ns_TlsGet(&timeoutTls);
+    int   timeout;
+
+    timeout = override != NULL
+        ? (int) PTR2INT(override) - 1 : ltHandle->ltCfg->stmtTimeout;
+
+    Ns_GetTime(&ltHandle->stmtStart);
+    ltHandle->running = 1;
+    ltHandle->timedOut = 0;
+
+    if (timeout > 0) {
+        ltHandle->deadline = ltHandle->stmtStart;
+        Ns_IncrTime(&ltHandle->deadline, timeout / 1000, (timeout % 1000) * 1000);
+        if (ltHandle->timeout == 0) {
+            sqlite3_progress_handler(ltHandle->conn, 1000, ProgressHandler, ltHandle);
+        }
+    } else if (ltHandle->timeout > 0) {
+        sqlite3_progress_handler(ltHandle->conn, 0, NULL, NULL);
+    }
+    ltHandle->timeout = timeout;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProgressHandler --
+ *
+ *      Called by sqlite every 1000 virtual machine instructions of a
+ *      statement with a timeout.
+ *
+ * Results:
+ *      Non-zero to interrupt the statement once past its deadline.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ProgressHandler(void *arg)
+{
+    LiteHandle *ltHandle = arg;
+    Ns_Time     now;
+
+    Ns_GetTime(&now);
+    if (Ns_DiffTime(&now, &ltHandle->deadline, NULL) > 0) {
+        ltHandle->timedOut = 1;
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StepStmt --
+ *
+ *      Call sqlite3_step() and account for it.
+ *
+ * Results:
+ *      The sqlite result code.
+ *
+ * Side effects:
+ *      Time spent waiting for locks is added to waitPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+StepStmt(LiteHandle *ltHandle, sqlite3_stmt *st, Ns_Time *waitPtr)
+{
+    int rc;
+
+    rc = sqlite3_step(st);
+    BusyDone(ltHandle, waitPtr);
+    ltHandle->stats.steps++;
+    if (rc == SQLITE_ROW) {
+        ltHandle->stats.rows++;
+    }
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NewHandle --
+ *
+ *      Open and configure a connection to the pool's datasource.
+ *
+ * Results:
+ *      Pointer to LiteHandle, or NULL with the error message left
+ *      in dsPtr.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static LiteHandle *
+NewHandle(LiteConfig *ltCfg, Ns_DString *dsPtr)
+{
+    LiteHandle *ltHandle;
+    sqlite3    *conn;
+
+    if (sqlite3_open_v2(ltCfg->datasource, &conn, ltCfg->openFlags, NULL)
+            != SQLITE_OK) {
+        Ns_DStringAppend(dsPtr, sqlite3_errmsg(conn));
+        (void) sqlite3_close(conn);
+        return NULL;
+    }
+    ltHandle = ns_calloc(1, sizeof(LiteHandle));
+    ltHandle->ltCfg = ltCfg;
+    ltHandle->conn = conn;
+    Tcl_InitHashTable(&ltHandle->warm, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&ltHandle->masks, TCL_ONE_WORD_KEYS);
+    Tcl_InitHashTable(&ltHandle->uncached, TCL_ONE_WORD_KEYS);
+    Ns_DStringInit(&ltHandle->fillKey);
+    Ns_DStringInit(&ltHandle->fillCells);
+    Ns_DStringInit(&ltHandle->fillData);
+
+    Ns_MutexLock(&ltCfg->lock);
+    ltHandle->nextLivePtr = ltCfg->livePtr;
+    if (ltCfg->livePtr != NULL) {
+        ltCfg->livePtr->prevLivePtr = ltHandle;
+    }
+    ltCfg->livePtr = ltHandle;
+    Ns_MutexUnlock(&ltCfg->lock);
+
+    if (ConfigureConn(ltHandle, dsPtr) != NS_OK) {
+        FreeHandle(ltHandle);
+        return NULL;
+    }
+    if (ltCfg->cache != NULL) {
+        ltHandle->dataVersion = CacheVersion(ltHandle);
+    }
+    return ltHandle;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeHandle --
+ *
+ *      Close the connection and free the handle.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeHandle(LiteHandle *ltHandle)
+{
+    LiteConfig     *ltCfg = ltHandle->ltCfg;
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    int             i;
+
+    CacheRelease(ltHandle);
+    Ns_DStringFree(&ltHandle->fillKey);
+    Ns_DStringFree(&ltHandle->fillCells);
+    Ns_DStringFree(&ltHandle->fillData);
+    (void) sqlite3_finalize(ltHandle->versionStmt);
+
+    for (i = 0; i < LITE_TXN_NUM; i++) {
+        (void) sqlite3_finalize(ltHandle->txnStmts[i]);
+    }
+    hPtr = Tcl_FirstHashEntry(&ltHandle->warm, &search);
+    while (hPtr != NULL) {
+        (void) sqlite3_finalize(Tcl_GetHashValue(hPtr));
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&ltHandle->warm);
+    Tcl_DeleteHashTable(&ltHandle->masks);
+    Tcl_DeleteHashTable(&ltHandle->uncached);
+
+    Ns_MutexLock(&ltCfg->lock);
+    if (ltHandle->prevLivePtr != NULL) {
+        ltHandle->prevLivePtr->nextLivePtr = ltHandle->nextLivePtr;
+    } else {
+        ltCfg->livePtr = ltHandle->nextLivePtr;
+    }
+    if (ltHandle->nextLivePtr != NULL) {
+        ltHandle->nextLivePtr->prevLivePtr = ltHandle->prevLivePtr;
+    }
+    memset(ltHandle->stats.memory, 0, sizeof(ltHandle->stats.memory));
+    AddStats(&ltCfg->stats, &ltHandle->stats);
+    Ns_MutexUnlock(&ltCfg->lock);
+
+    if (sqlite3_close(ltHandle->conn) != SQLITE_OK) {
+        Ns_Log(Error, "dbilite: error closing db handle: %s",
+               sqlite3_errmsg(ltHandle->conn));
+    }
+    ns_free(ltHandle);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BindValues --
+ *
+ *      Bind nsdbi values to a prepared statement.
+ *
+ * Results:
+ *      An sqlite result code.
+ *
+ * Side effects:
+ *      Values are bound SQLITE_STATIC and must remain valid until
+ *      the statement is reset or rebound.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BindValues(sqlite3_stmt *st, Dbi_Value *values, unsigned int numValues,
+           int bindMode)
+{
+    unsigned int i;
+    int          rc = SQLITE_OK;
+
+    /*
+     * NB: sqlite indexes variables from 1, nsdbi from 0.
+     */
+
+    for (i = 0u; i < numValues && rc == SQLITE_OK; i++) {
+        if (values[i].data == NULL) {
+            rc = sqlite3_bind_null(st, (int)i+1);
+        } else if (values[i].binary) {
+            rc = sqlite3_bind_blob(st, (int)i+1, values[i].data, (int)values[i].length,
+                                   SQLITE_STATIC);
+        } else {
+            rc = BindText(st, (int)i+1, values[i].data, values[i].length,
+                          bindMode);
+        }
+    }
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BindText --
+ *
+ *      Bind a text value, as an integer or real if the pool is so
+ *      configured and the value is the canonical text form of the
+ *      number. Only canonical forms are converted, e.g. 42 but not
+ *      042 or 4.20, so that comparisons against TEXT columns, which
+ *      convert the number back to text, behave as before.
+ *
+ * Results:
+ *      An sqlite result code.
+ *
+ * Side effects:
+ *      Text is bound SQLITE_STATIC.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BindText(sqlite3_stmt *st, int index, CONST char *data, size_t length,
+         int bindMode)
+{
+    sqlite3_int64 i;
+    double        d;
+
+    if (bindMode != LITE_BIND_TEXT) {
+        if (ParseInteger(data, length, &i)) {
+            return sqlite3_bind_int64(st, index, i);
+        }
+        if (bindMode == LITE_BIND_NUMERIC && ParseReal(data, length, &d)) {
+            return sqlite3_bind_double(st, index, d);
+        }
+    }
+    return sqlite3_bind_text(st, index, data, (int)length, SQLITE_STATIC);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseInteger --
+ *
+ *      Parse a canonical 64bit integer: an optional minus sign and
+ *      digits without leading zeros.
+ *
+ * Results:
+ *      1 if valid with the value left in iPtr, 0 otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseInteger(CONST char *data, size_t length, sqlite3_int64 *iPtr)
+{
+    sqlite3_uint64 u = 0u, max = (sqlite3_uint64) 0x7fffffffffffffffLL;
+    size_t         i = 0u;
+    int            neg = 0;
+
+    if (length > 0u && data[0] == '-') {
+        neg = 1;
+        max++;
+        i++;
+    }
+    if (i == length || length - i > 19u
+            || (data[i] == '0' && (length - i > 1u || neg))) {
+        return 0;
+    }
+    for (; i < length; i++) {
+        if (data[i] < '0' || data[i] > '9') {
+            return 0;
+        }
+        u = u * 10u + (sqlite3_uint64)(data[i] - '0');
+    }
+    if (u > max) {
+        return 0;
+    }
+    *iPtr = neg ? (sqlite3_int64)(0u - u) : (sqlite3_int64) u;
+
+    return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseReal --
+ *
+ *      Parse a real number which sqlite converts back to the same
+ *      text, i.e. it is in the form printed with %!.15g.
+ *
+ * Results:
+ *      1 if valid with the value left in dPtr, 0 otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ParseReal(CONST char *data, size_t length, double *dPtr)
+{
+    char    buf[32], canon[32], *end;
+    double  d;
+    size_t  i;
+
+    if (length == 0u || length >= sizeof(buf)) {
+        return 0;
+    }
+    for (i = 0u; i < length; i++) {
+        if (strchr("0123456789.eE+-", data[i]) == NULL) {
+            return 0;
+        }
+    }
+    memcpy(buf, data, length);
+    buf[length] = '\0';
+
+    d = strtod(buf, &end);
+    if (*end != '\0') {
+        return 0;
+    }
+    sqlite3_snprintf((int) sizeof(canon), canon, "%!.15g", d);
+    if (strcmp(buf, canon) != 0) {
+        return 0;
+    }
+    *dPtr = d;
+
+    return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TxnStep --
+ *
+ *      Run one of the transaction control statements, preparing it
+ *      the first time it is used by this handle.
+ *
+ * Results:
+ *      SQLITE_OK, or an sqlite error code with the message left in
+ *      the connection.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TxnStep(LiteHandle *ltHandle, int txn)
+{
+    sqlite3_stmt *st = ltHandle->txnStmts[txn];
+    Ns_Time       wait;
+    int           rc;
+
+    if (st == NULL) {
+        rc = sqlite3_prepare_v3(ltHandle->conn, txnSql[txn], -1,
+                                SQLITE_PREPARE_PERSISTENT, &st, NULL);
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+        ltHandle->txnStmts[txn] = st;
+    }
+    wait.sec = wait.usec = 0;
+    rc = StepStmt(ltHandle, st, &wait);
+    (void) sqlite3_reset(st);
+    if (txn <= LITE_TXN_BEGIN_EXCLUSIVE && rc == SQLITE_DONE) {
+        ltHandle->stats.transactions++;
+    }
+
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetCell --
+ *
+ *      Look up the type, value and length of a cell in the current
+ *      row once, for both ColumnLength() and ColumnValue().
+ *
+ *      The value is fetched before its length as sqlite3_column_bytes()
+ *      would otherwise have to convert a number to text itself, only
+ *      to do so again for sqlite3_column_text(). Integers are formatted
+ *      here rather than by sqlite, which would keep a text copy in the
+ *      cell.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The cell pointer remains valid until the next step or reset
+ *      of the statement.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+GetCell(LiteHandle *ltHandle, sqlite3_stmt *st, unsigned int index)
+{
+    LiteResult *resPtr = ltHandle->hitPtr;
+    LiteCell   *cellPtr;
+    int         col = (int) index;
+
+    if (resPtr != NULL && ltHandle->hitStmt == st) {
+        cellPtr = &resPtr->cells[ltHandle->hitRow * resPtr->numCols + index];
+        ltHandle->cellData   = cellPtr->type == SQLITE_NULL
+            ? NULL : resPtr->data + cellPtr->offset;
+        ltHandle->cellLength = cellPtr->length;
+        ltHandle->cellBinary = cellPtr->type == SQLITE_BLOB;
+        ltHandle->cellStmt   = st;
+        ltHandle->cellIndex  = index;
+        return;
+    }
+
+    switch (sqlite3_column_type(st, col)) {
+    case SQLITE_NULL:
+        ltHandle->cellData   = NULL;
+        ltHandle->cellLength = 0u;
+        ltHandle->cellBinary = 0;
+        break;
+    case SQLITE_BLOB:
+        ltHandle->cellData   = sqlite3_column_blob(st, col);
+        ltHandle->cellLength = (size_t) sqlite3_column_bytes(st, col);
+        ltHandle->cellBinary = 1;
+        break;
+    case SQLITE_INTEGER:
+        ltHandle->cellLength = FormatInt(ltHandle->cellBuf,
+                                         sqlite3_column_int64(st, col));
+        ltHandle->cellData   = ltHandle->cellBuf;
+        ltHandle->cellBinary = 0;
+        break;
+    default:
+        ltHandle->cellData   = sqlite3_column_text(st, col);
+        ltHandle->cellLength = (size_t) sqlite3_column_bytes(st, col);
+        ltHandle->cellBinary = 0;
+        break;
+    }
+    ltHandle->cellStmt  = st;
+    ltHandle->cellIndex = index;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FormatInt --
+ *
+ *      Format an integer in decimal, as sqlite would.
+ *
+ * Results:
+ *      The length of the text, which is not terminated.
+ *
+ * Side effects:
+ *      The text is left in buf, of at least 20 bytes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static size_t
+FormatInt(char *buf, sqlite3_int64 value)
+{
+    char            tmp[20], *p = tmp + sizeof(tmp);
+    sqlite3_uint64  u;
+    size_t          length;
+
+    u = value < 0 ? 0u - (sqlite3_uint64) value : (sqlite3_uint64) value;
+    do {
+        *--p = (char) ('0' + (int) (u % 10u));
+        u /= 10u;
+    } while (u > 0u);
+    if (value < 0) {
+        *--p = '-';
+    }
+    length = (size_t) (tmp + sizeof(tmp) - p);
+    memcpy(buf, p, length);
+
+    return length;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ColumnObj --
+ *
+ *      Make a Tcl object of the native type of a cell in the current
+ *      row: wide integer, double, byte array, string, or empty for
+ *      null.
+ *
+ * Results:
+ *      New Tcl object with refcount 0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ColumnObj(sqlite3_stmt *st, int col)
+{
+    switch (sqlite3_column_type(st, col)) {
+    case SQLITE_INTEGER:
+        return Tcl_NewWideIntObj((Tcl_WideInt) sqlite3_column_int64(st, col));
+    case SQLITE_FLOAT:
+        return Tcl_NewDoubleObj(sqlite3_column_double(st, col));
+    case SQLITE_BLOB:
+        return Tcl_NewByteArrayObj(sqlite3_column_blob(st, col),
+                                   sqlite3_column_bytes(st, col));
+    case SQLITE_TEXT:
+        return Tcl_NewStringObj((CONST char *) sqlite3_column_text(st, col),
+                                sqlite3_column_bytes(st, col));
+    default:
+        return Tcl_NewObj();
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheInit --
+ *
+ *      Create the result cache of a pool if resultcache is set.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Pools with shards get no cache, as only the data version of
+ *      main is checked for changes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheInit(LiteConfig *ltCfg, CONST char *path)
+{
+    LiteCache *cache;
+    int        kbytes;
+
+    kbytes = Ns_ConfigIntRange(path, "resultcache", 0, 0, INT_MAX / 1024);
+    if (kbytes == 0) {
+        return;
+    }
+    if (ltCfg->numShards > 0) {
+        Ns_Log(Error, "dbilite: %s: resultcache ignored, it can't see"
+               " changes to shards", ltCfg->module);
+        return;
+    }
+    cache = ns_calloc(1, sizeof(LiteCache));
+    cache->maxSize   = (size_t) kbytes * 1024u;
+    cache->maxResult = (size_t) Ns_ConfigIntRange(path, "resultcachemax",
+                                                  MAX(kbytes / 8, 1), 1,
+                                                  kbytes) * 1024u;
+    Tcl_InitHashTable(&cache->results, TCL_STRING_KEYS);
+    Ns_MutexInit(&cache->lock);
+    Ns_MutexSetName2(&cache->lock, "dbilite:cache", ltCfg->module);
+
+    ltCfg->cache = cache;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheLookup --
+ *
+ *      Look for the result of a read-only query with the given values
+ *      in the cache. On a miss, get ready to cache the rows.
+ *
+ * Results:
+ *      1 on a hit, 0 otherwise.
+ *
+ * Side effects:
+ *      Queries inside a transaction, which may see its own changes,
+ *      queries calling built-in functions such as random() or
+ *      datetime(), and queries with binary values aren't cached.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CacheLookup(LiteHandle *ltHandle, sqlite3_stmt *st,
+            Dbi_Value *values, unsigned int numValues)
+{
+    LiteCache     *cache = ltHandle->ltCfg->cache;
+    LiteResult    *resPtr = NULL;
+    Tcl_HashEntry *hPtr;
+    Ns_DString    *keyPtr = &ltHandle->fillKey;
+    unsigned long  generation;
+    unsigned int   i;
+
+    CacheRelease(ltHandle);
+
+    if (!sqlite3_stmt_readonly(st) || !sqlite3_get_autocommit(ltHandle->conn)
+            || Tcl_FindHashEntry(&ltHandle->uncached, (char *) st) != NULL) {
+        return 0;
+    }
+    Ns_DStringAppend(keyPtr, sqlite3_sql(st));
+    for (i = 0u; i < numValues; i++) {
+        if (values[i].data == NULL) {
+            Ns_DStringNAppend(keyPtr, "\x1f-", 2);
+        } else if (values[i].binary
+                   || memchr(values[i].data, '\0', values[i].length) != NULL) {
+            Ns_DStringSetLength(keyPtr, 0);
+            return 0;
+        } else {
+            Ns_DStringPrintf(keyPtr, "\x1f%lu:", (unsigned long) values[i].length);
+            Ns_DStringNAppend(keyPtr, values[i].data, (int) values[i].length);
+        }
+    }
+
+    generation = CacheGeneration(ltHandle);
+
+    Ns_MutexLock(&cache->lock);
+    hPtr = Tcl_FindHashEntry(&cache->results, Ns_DStringValue(keyPtr));
+    if (hPtr != NULL) {
+        resPtr = Tcl_GetHashValue(hPtr);
+        if (resPtr->generation != generation) {
+            CacheUnlink(cache, resPtr);
+            resPtr = NULL;
+        } else {
+            resPtr->refCount++;
+            if (resPtr->prevPtr != NULL) {
+                resPtr->prevPtr->nextPtr = resPtr->nextPtr;
+                if (resPtr->nextPtr != NULL) {
+                    resPtr->nextPtr->prevPtr = resPtr->prevPtr;
+                } else {
+                    cache->lastPtr = resPtr->prevPtr;
+                }
+                resPtr->prevPtr = NULL;
+                resPtr->nextPtr = cache->firstPtr;
+                cache->firstPtr->prevPtr = resPtr;
+                cache->firstPtr = resPtr;
+            }
+        }
+    }
+    Ns_MutexUnlock(&cache->lock);
+
+    if (resPtr != NULL) {
+        ltHandle->stats.cacheHits++;
+        ltHandle->hitPtr  = resPtr;
+        ltHandle->hitStmt = st;
+        ltHandle->hitRow  = -1;
+        Ns_DStringSetLength(keyPtr, 0);
+        return 1;
+    }
+
+    ltHandle->stats.cacheMisses++;
+    ltHandle->fillStmt = st;
+    ltHandle->fillGeneration = generation;
+    ltHandle->fillRows = 0;
+
+    return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheRow --
+ *
+ *      Copy the current row of the query being cached.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Gives up on caching the query once it is larger than
+ *      resultcachemax.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheRow(LiteHandle *ltHandle)
+{
+    sqlite3_stmt *st = ltHandle->fillStmt;
+    LiteCell      cell;
+    int           col, numCols = sqlite3_column_count(st);
+
+    for (col = 0; col < numCols; col++) {
+        cell.type   = sqlite3_column_type(st, col);
+        cell.offset = (size_t) Ns_DStringLength(&ltHandle->fillData);
+        cell.length = 0u;
+        if (cell.type == SQLITE_BLOB) {
+            cell.length = (size_t) sqlite3_column_bytes(st, col);
+            Ns_DStringNAppend(&ltHandle->fillData, sqlite3_column_blob(st, col),
+                              (int) cell.length);
+        } else if (cell.type == SQLITE_INTEGER) {
+            cell.type   = SQLITE_TEXT;
+            cell.length = FormatInt(ltHandle->cellBuf, sqlite3_column_int64(st, col));
+            Ns_DStringNAppend(&ltHandle->fillData, ltHandle->cellBuf,
+                              (int) cell.length);
+        } else if (cell.type != SQLITE_NULL) {
+            cell.type   = SQLITE_TEXT;
+            cell.length = (size_t) sqlite3_column_bytes(st, col);
+            Ns_DStringNAppend(&ltHandle->fillData,
+                              (CONST char *) sqlite3_column_text(st, col),
+                              (int) cell.length);
+        }
+        Ns_DStringNAppend(&ltHandle->fillCells, (char *) &cell, sizeof(cell));
+    }
+    ltHandle->fillRows++;
+
+    if ((size_t) (Ns_DStringLength(&ltHandle->fillCells)
+                  + Ns_DStringLength(&ltHandle->fillData))
+            > ltHandle->ltCfg->cache->maxResult) {
+        CacheRelease(ltHandle);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheStore --
+ *
+ *      Add the rows of a completed query to the cache.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Least recently used results are dropped to make room.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheStore(LiteHandle *ltHandle)
+{
+    LiteCache     *cache = ltHandle->ltCfg->cache;
+    LiteResult    *resPtr;
+    Tcl_HashEntry *hPtr;
+    size_t         cellsLength, dataLength;
+    int            isNew;
+
+    if (ltHandle->fillGeneration != cache->generation) {
+        CacheRelease(ltHandle);
+        return;
+    }
+    cellsLength = (size_t) Ns_DStringLength(&ltHandle->fillCells);
+    dataLength  = (size_t) Ns_DStringLength(&ltHandle->fillData);
+
+    resPtr = ns_malloc(sizeof(LiteResult) + cellsLength + dataLength);
+    resPtr->nextPtr    = resPtr->prevPtr = NULL;
+    resPtr->generation = ltHandle->fillGeneration;
+    resPtr->refCount   = 0;
+    resPtr->numCols    = (unsigned int) sqlite3_column_count(ltHandle->fillStmt);
+    resPtr->numRows    = ltHandle->fillRows;
+    resPtr->size       = sizeof(LiteResult) + cellsLength + dataLength
+        + (size_t) Ns_DStringLength(&ltHandle->fillKey);
+    resPtr->cells      = (LiteCell *) (resPtr + 1);
+    resPtr->data       = (char *) resPtr->cells + cellsLength;
+    memcpy(resPtr->cells, Ns_DStringValue(&ltHandle->fillCells), cellsLength);
+    memcpy(resPtr->data, Ns_DStringValue(&ltHandle->fillData), dataLength);
+
+    Ns_MutexLock(&cache->lock);
+    hPtr = Tcl_CreateHashEntry(&cache->results,
+                               Ns_DStringValue(&ltHandle->fillKey), &isNew);
+    if (!isNew) {
+        CacheUnlink(cache, Tcl_GetHashValue(hPtr));
+        hPtr = Tcl_CreateHashEntry(&cache->results,
+                                   Ns_DStringValue(&ltHandle->fillKey), &isNew);
+    }
+    while (cache->lastPtr != NULL && cache->size + resPtr->size > cache->maxSize) {
+        CacheUnlink(cache, cache->lastPtr);
+    }
+    resPtr->hPtr = hPtr;
+    Tcl_SetHashValue(hPtr, resPtr);
+    resPtr->nextPtr = cache->firstPtr;
+    if (cache->firstPtr != NULL) {
+        cache->firstPtr->prevPtr = resPtr;
+    } else {
+        cache->lastPtr = resPtr;
+    }
+    cache->firstPtr = resPtr;
+    cache->size += resPtr->size;
+    Ns_MutexUnlock(&cache->lock);
+
+    CacheRelease(ltHandle);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheRelease --
+ *
+ *      Stop returning a cached result and discard rows being cached.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frees the result if it was dropped from the cache meanwhile.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheRelease(LiteHandle *ltHandle)
+{
+    LiteCache  *cache = ltHandle->ltCfg->cache;
+    LiteResult *resPtr = ltHandle->hitPtr;
+
+    if (resPtr != NULL) {
+        Ns_MutexLock(&cache->lock);
+        if (--resPtr->refCount == 0 && resPtr->hPtr == NULL) {
+            ns_free(resPtr);
+        }
+        Ns_MutexUnlock(&cache->lock);
+        ltHandle->hitPtr = NULL;
+        ltHandle->hitStmt = NULL;
+    }
+    if (ltHandle->fillStmt != NULL) {
+        ltHandle->fillStmt = NULL;
+        Ns_DStringSetLength(&ltHandle->fillCells, 0);
+        Ns_DStringSetLength(&ltHandle->fillData, 0);
+    }
+    Ns_DStringSetLength(&ltHandle->fillKey, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheUnlink --
+ *
+ *      Drop a result from the cache. Called with the cache locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The result is freed once no handle is returning it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheUnlink(LiteCache *cache, LiteResult *resPtr)
+{
+    if (resPtr->prevPtr != NULL) {
+        resPtr->prevPtr->nextPtr = resPtr->nextPtr;
+    } else {
+        cache->firstPtr = resPtr->nextPtr;
+    }
+    if (resPtr->nextPtr != NULL) {
+        resPtr->nextPtr->prevPtr = resPtr->prevPtr;
+    } else {
+        cache->lastPtr = resPtr->prevPtr;
+    }
+    Tcl_DeleteHashEntry(resPtr->hPtr);
+    resPtr->hPtr = NULL;
+    cache->size -= resPtr->size;
+
+    if (resPtr->refCount == 0) {
+        ns_free(resPtr);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheGeneration, CacheVersion --
+ *
+ *      Check whether the database changed since this handle last
+ *      looked, and if so invalidate the cache. The data versions of
+ *      connections can't be compared, so each handle starts from the
+ *      version of its connection when opened, before it could write.
+ *
+ * Results:
+ *      CacheGeneration: the current cache generation.
+ *      CacheVersion: the data version of the connection.
+ *
+ * Side effects:
+ *      Runs pragma data_version to start a read transaction, which
+ *      updates the data version sqlite keeps for the connection. It
+ *      changes with commits by any connection, including this one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned long
+CacheGeneration(LiteHandle *ltHandle)
+{
+    LiteCache     *cache = ltHandle->ltCfg->cache;
+    unsigned int   version;
+    unsigned long  generation;
+
+    if (ltHandle->ltCfg->immutable) {
+        version = ltHandle->dataVersion;
+    } else {
+        version = CacheVersion(ltHandle);
+    }
+
+    Ns_MutexLock(&cache->lock);
+    if (version != ltHandle->dataVersion) {
+        ltHandle->dataVersion = version;
+        cache->generation++;
+    }
+    generation = cache->generation;
+    Ns_MutexUnlock(&cache->lock);
+
+    return generation;
+}
+
+static unsigned int
+CacheVersion(LiteHandle *ltHandle)
+{
+    unsigned int version = 0u;
+
+    if (ltHandle->versionStmt == NULL) {
+        (void) sqlite3_prepare_v3(ltHandle->conn, "pragma data_version", -1,
+                                  SQLITE_PREPARE_PERSISTENT,
+                                  &ltHandle->versionStmt, NULL);
+    }
+    if (ltHandle->versionStmt != NULL) {
+        (void) sqlite3_step(ltHandle->versionStmt);
+        (void) sqlite3_reset(ltHandle->versionStmt);
+    }
+    (void) sqlite3_file_control(ltHandle->conn, "main",
+                                SQLITE_FCNTL_DATA_VERSION, &version);
+    return version;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigPrewarm --
+ *
+ *      Collect the statements to prepare on each new handle from any
+ *      number of "prepare" keys and an optional "preparefile" of
+ *      statements separated by semicolons.
+ *
+ * Results:
+ *      SQL script or NULL if none configured.
+ *
+ * Side effects:
+ *      The file is read once, at startup.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CONST char *
+ConfigPrewarm(CONST char *path)
+{
+    Ns_Set     *set;
+    Ns_DString  ds;
+    CONST char *file, *prewarm = NULL;
+    FILE       *fp;
+    char        buf[4096];
+    size_t      i, n;
+
+    Ns_DStringInit(&ds);
+
+    set = Ns_ConfigGetSection(path);
+    for (i = 0u; set != NULL && i < Ns_SetSize(set); i++) {
+        if (strcasecmp(Ns_SetKey(set, i), "prepare") == 0) {
+            Ns_DStringPrintf(&ds, "%s;\n", Ns_SetValue(set, i));
+        }
+    }
+
+    file = Ns_ConfigGetValue(path, "preparefile");
+    if (file != NULL) {
+        fp = fopen(file, "r");
+        if (fp == NULL) {
+            Ns_Log(Error, "dbilite: %s: could not open preparefile %s: %s",
+                   path, file, strerror(errno));
+        } else {
+            while ((n = fread(buf, 1u, sizeof(buf), fp)) > 0u) {
+                Ns_DStringNAppend(&ds, buf, (int) n);
+            }
+            (void) fclose(fp);
+        }
+    }
+
+    if (Ns_DStringLength(&ds) > 0) {
+        prewarm = ns_strdup(Ns_DStringValue(&ds));
+    }
+    Ns_DStringFree(&ds);
+
+    return prewarm;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Prewarm --
+ *
+ *      Prepare the configured statements on a new handle so the
+ *      first queries after a handle is recycled don't pay the
+ *      compile cost. Prepare() hands them to nsdbi when it first
+ *      sees the same query.
+ *
+ *      Statements must be written as nsdbi passes them to the
+ *      driver, i.e. with ? in place of each :variable.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Statements which fail to compile are logged and skipped.
+ *      Those which compile are counted as prepared.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Prewarm(LiteHandle *ltHandle)
+{
+    sqlite3_stmt  *st;
+    Tcl_HashEntry *hPtr;
+    Ns_DString     ds;
+    CONST char    *sql, *tail;
+    int            isNew;
+
+    Ns_DStringInit(&ds);
+    for (sql = ltHandle->ltCfg->prewarm; *sql != '\0'; sql = tail) {
+        tail = NULL;
+        ltHandle->authVolatile = 0;
+        if (sqlite3_prepare_v3(ltHandle->conn, sql, -1,
+                               SQLITE_PREPARE_PERSISTENT, &st, &tail)
+                != SQLITE_OK) {
+            Ns_Log(Warning, "dbilite: %s: prepare failed: %s",
+                   ltHandle->ltCfg->module, sqlite3_errmsg(ltHandle->conn));
+            if (tail == NULL || tail == sql) {
+                break;
+            }
+            continue;
+        }
+        if (st == NULL) {
+            continue; /* Whitespace or comment. */
+        }
+        ltHandle->stats.prepares++;
+        NormalizeSql(&ds, sql, (int)(tail - sql));
+        hPtr = Tcl_CreateHashEntry(&ltHandle->warm, Ns_DStringValue(&ds), &isNew);
+        if (isNew) {
+            Tcl_SetHashValue(hPtr, st);
+            if (ltHandle->authVolatile) {
+                (void) Tcl_CreateHashEntry(&ltHandle->uncached, (char *) st, &isNew);
+            }
+        } else {
+            (void) sqlite3_finalize(st);
+        }
+        Ns_DStringTrunc(&ds, 0);
+    }
+    Ns_DStringFree(&ds);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EmptyTail --
+ *
+ *      Check that what follows a prepared statement is only
+ *      whitespace, semicolons and comments.
+ *
+ * Results:
+ *      1 if empty, 0 otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EmptyTail(CONST char *tail, CONST char *end)
+{
+    while (tail != NULL && tail < end) {
+        if (isspace(UCHAR(*tail)) || *tail == ';') {
+            tail++;
+        } else if (tail + 1 < end && tail[0] == '-' && tail[1] == '-') {
+            while (tail < end && *tail != '\n') {
+                tail++;
+            }
+        } else if (tail + 1 < end && tail[0] == '/' && tail[1] == '*') {
+            for (tail += 2; tail < end; tail++) {
+                if (tail + 1 < end && tail[0] == '*' && tail[1] == '/') {
+                    tail += 2;
+                    break;
+                }
+            }
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NormalizeSql --
+ *
+ *      Copy a statement without surrounding whitespace and trailing
+ *      semicolons, for matching prewarmed statements.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Appends to dsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+NormalizeSql(Ns_DString *dsPtr, CONST char *sql, int length)
+{
+    CONST char *end;
+
+    if (length < 0) {
+        length = (int) strlen(sql);
+    }
+    end = sql + length;
+    while (sql < end && isspace(UCHAR(*sql))) {
+        sql++;
+    }
+    while (end > sql && (isspace(UCHAR(end[-1])) || end[-1] == ';')) {
+        end--;
+    }
+    Ns_DStringNAppend(dsPtr, sql, (int)(end - sql));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigPragmas --
+ *
+ *      Build the script of pragmas to run on each new connection from
+ *      the tuning keys in the module config section. Free-form
+ *      pragmas may be given with one or more "pragma" keys.
+ *
+ * Results:
+ *      Pragma script or NULL if none configured.
+ *
+ * Side effects:
+ *      Invalid values are logged and ignored.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CONST char *
+ConfigPragmas(CONST char *path)
+{
+    Ns_Set     *set;
+    Ns_DString  ds;
+    CONST char *pragmas = NULL;
+    size_t      i;
+
+    Ns_DStringInit(&ds);
+
+    ConfigPragma(&ds, path, "journal_mode",       journalModes);
+    ConfigPragma(&ds, path, "synchronous",        syncModes);
+    ConfigPragma(&ds, path, "temp_store",         tempStores);
+    ConfigPragma(&ds, path, "cache_size",         NULL);
+    ConfigPragma(&ds, path, "mmap_size",          NULL);
+    ConfigPragma(&ds, path, "wal_autocheckpoint", NULL);
+    ConfigPragma(&ds, path, "auto_vacuum",        vacuumModes);
+    ConfigPragma(&ds, path, "analysis_limit",     NULL);
+
+    if (Ns_ConfigBool(path, "immutable", NS_FALSE)) {
+        Ns_DStringAppend(&ds, "PRAGMA query_only = 1;\n");
+        if (Ns_ConfigGetValue(path, "mmap_size") == NULL) {
+            Ns_DStringAppend(&ds, "PRAGMA mmap_size = 1073741824;\n");
+        }
+    }
+
+    set = Ns_ConfigGetSection(path);
+    for (i = 0u; set != NULL && i < Ns_SetSize(set); i++) {
+        if (strcasecmp(Ns_SetKey(set, i), "pragma") == 0) {
+            Ns_DStringPrintf(&ds, "PRAGMA %s;\n", Ns_SetValue(set, i));
+        }
+    }
+
+    if (Ns_DStringLength(&ds) > 0) {
+        pragmas = ns_strdup(Ns_DStringValue(&ds));
+    }
+    Ns_DStringFree(&ds);
+
+    return pragmas;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigPragma --
+ *
+ *      Append a single pragma to the given dstring if the key is
+ *      present in the config section. The value must be one of the
+ *      given choices, or an integer if choices is NULL.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Invalid values are logged and ignored.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ConfigPragma(Ns_DString *dsPtr, CONST char *path, CONST char *key,
+             CONST char *CONST *choices)
+{
+    CONST char *value;
+    char       *end;
+    int         i;
+
+    value = Ns_ConfigGetValue(path, key);
+    if (value == NULL) {
+        return;
+    }
+    if (choices != NULL) {
+        for (i = 0; choices[i] != NULL; i++) {
+            if (strcasecmp(value, choices[i]) == 0) {
+                break;
+            }
+        }
+        if (choices[i] == NULL) {
+            Ns_Log(Error, "dbilite: %s: invalid %s: %s", path, key, value);
+            return;
+        }
+    } else {
+        (void) strtoll(value, &end, 10);
+        if (*value == '\0' || *end != '\0') {
+            Ns_Log(Error, "dbilite: %s: invalid %s: %s", path, key, value);
+            return;
+        }
+    }
+    Ns_DStringPrintf(dsPtr, "PRAGMA %s = %s;\n", key, value);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigureConn --
+ *
+ *      Apply the per-pool busy handler and pragmas to a newly opened
+ *      connection.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR with the error message left in dsPtr.
+ *
+ * Side effects:
+ *      A mismatched journal_mode is logged, e.g. WAL on :memory:.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ConfigureConn(LiteHandle *ltHandle, Ns_DString *dsPtr)
+{
+    LiteConfig *ltCfg = ltHandle->ltCfg;
+    sqlite3    *conn  = ltHandle->conn;
+    char       *errmsg = NULL, *sql;
+    int         i;
+
+    /*
+     * Install the busy handler first so that pragmas which need
+     * a lock, such as journal_mode, wait for it.
+     */
+
+    (void) sqlite3_busy_handler(conn, BusyHandler, ltHandle);
+
+    if (ltCfg->lookasideSize > 0
+            && sqlite3_db_config(conn, SQLITE_DBCONFIG_LOOKASIDE, NULL,
+                                 ltCfg->lookasideSize, ltCfg->lookasideCount)
+               != SQLITE_OK) {
+        Ns_Log(Warning, "dbilite: %s: could not configure lookaside: %s",
+               ltCfg->module, sqlite3_errmsg(conn));
+    }
+
+    if (ltCfg->slowTime > 0) {
+        (void) sqlite3_trace_v2(conn, SQLITE_TRACE_PROFILE, TraceProfile, ltHandle);
+    }
+
+    for (i = 0; i < ltCfg->numShards; i++) {
+        sql = sqlite3_mprintf("ATTACH %Q AS %Q",
+                              ltCfg->shardPaths[i], ltCfg->shardNames[i]);
+        if (sqlite3_exec(conn, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+            Ns_DStringPrintf(dsPtr, "dbilite: error attaching shard %s: %s",
+                             ltCfg->shardNames[i],
+                             errmsg != NULL ? errmsg : sqlite3_errmsg(conn));
+            sqlite3_free(errmsg);
+            sqlite3_free(sql);
+            return NS_ERROR;
+        }
+        sqlite3_free(sql);
+    }
+    if (ltCfg->shardFiles != NULL || ltCfg->cache != NULL) {
+        (void) sqlite3_set_authorizer(conn, Authorizer, ltHandle);
+    }
+
+    /*
+     * Extensions are loaded after the built-in functions so that they
+     * may replace them.
+     */
+
+    if (ltCfg->functions) {
+        (void) sqlite3_create_function_v2(conn, "regexp", 2,
+                                          SQLITE_UTF8 | SQLITE_DETERMINISTIC
+                                          | SQLITE_INNOCUOUS,
+                                          NULL, RegexpFunc, NULL, NULL, NULL);
+        (void) sqlite3_create_function_v2(conn, "levenshtein", 2,
+                                          SQLITE_UTF8 | SQLITE_DETERMINISTIC
+                                          | SQLITE_INNOCUOUS,
+                                          NULL, LevenshteinFunc, NULL, NULL, NULL);
+    }
+    if (ltCfg->numExtensions > 0 && LoadExtensions(ltHandle, dsPtr) != NS_OK) {
+        return NS_ERROR;
+    }
+
+    if (ltCfg->pragmas != NULL
+            && sqlite3_exec(conn, ltCfg->pragmas, PragmaResult, ltCfg, &errmsg)
+               != SQLITE_OK) {
+        Ns_DStringPrintf(dsPtr, "dbilite: error applying pragmas: %s",
+                         errmsg != NULL ? errmsg : sqlite3_errmsg(conn));
+        sqlite3_free(errmsg);
+        return NS_ERROR;
+    }
+
+    /*
+     * Leave checkpoints to CheckpointProc rather than the request
+     * which happens to commit past wal_autocheckpoint.
+     */
+
+    if (ltCfg->checkpointInterval > 0) {
+        (void) sqlite3_wal_autocheckpoint(conn, 0);
+    }
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CheckpointProc --
+ *
+ *      Scheduled proc which runs a passive WAL checkpoint, followed by
+ *      a truncating one if the WAL is longer than checkpointlimit.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Opens a connection on first use. A truncating checkpoint
+ *      waits for readers and blocks writers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CheckpointProc(void *arg, int UNUSED(id))
+{
+    LiteConfig *ltCfg = arg;
+    LiteHandle *ltHandle;
+    Ns_DString  ds;
+    Ns_Time     start, end, diff, wait;
+    int         rc, logFrames = 0, ckptFrames = 0;
+
+    if (ltCfg->checkpointPtr == NULL) {
+        Ns_DStringInit(&ds);
+        ltCfg->checkpointPtr = NewHandle(ltCfg, &ds);
+        if (ltCfg->checkpointPtr == NULL) {
+            Ns_Log(Error, "dbilite: %s: checkpoint failed: %s",
+                   ltCfg->module, Ns_DStringValue(&ds));
+            Ns_DStringFree(&ds);
+            return;
+        }
+        Ns_DStringFree(&ds);
+    }
+    ltHandle = ltCfg->checkpointPtr;
+    wait.sec = wait.usec = 0;
+
+    Ns_GetTime(&start);
+    rc = sqlite3_wal_checkpoint_v2(ltHandle->conn, NULL, SQLITE_CHECKPOINT_PASSIVE,
+                                   &logFrames, &ckptFrames);
+    if (rc == SQLITE_OK && logFrames >= ltCfg->checkpointLimit) {
+        rc = sqlite3_wal_checkpoint_v2(ltHandle->conn, NULL,
+                                       SQLITE_CHECKPOINT_TRUNCATE,
+                                       &logFrames, &ckptFrames);
+    }
+    BusyDone(ltHandle, &wait);
+    Ns_GetTime(&end);
+    (void) Ns_DiffTime(&end, &start, &diff);
+
+    ltHandle->stats.checkpoints++;
+    Ns_IncrTime(&ltHandle->stats.checkpointTime, diff.sec, diff.usec);
+
+    if (rc != SQLITE_OK && rc != SQLITE_BUSY) {
+        ltHandle->stats.errors++;
+        Ns_Log(Error, "dbilite: %s: checkpoint failed: %s",
+               ltCfg->module, sqlite3_errmsg(ltHandle->conn));
+    } else {
+        Ns_MutexLock(&ltCfg->lock);
+        ltCfg->stats.walPages = MAX(logFrames, 0);
+        Ns_MutexUnlock(&ltCfg->lock);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MaintenanceProc --
+ *
+ *      Scheduled proc which runs PRAGMA optimize, then releases free
+ *      pages in slices of vacuumpages while the database is in
+ *      incremental auto_vacuum mode, until none are left or the run
+ *      has taken maintenancetime msec.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Opens a connection on first use. Statements still running at
+ *      the end of the budget are interrupted and resume next run.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MaintenanceProc(void *arg, int UNUSED(id))
+{
+    LiteConfig *ltCfg = arg;
+    LiteHandle *ltHandle;
+    Ns_DString  ds;
+    Ns_Time     start, end, diff;
+    char       *sql;
+    int         mode = 0, pages = 0, rc = SQLITE_OK;
+
+    if (ltCfg->maintenancePtr == NULL) {
+        Ns_DStringInit(&ds);
+        ltCfg->maintenancePtr = NewHandle(ltCfg, &ds);
+        if (ltCfg->maintenancePtr == NULL) {
+            Ns_Log(Error, "dbilite: %s: maintenance failed: %s",
+                   ltCfg->module, Ns_DStringValue(&ds));
+            Ns_DStringFree(&ds);
+            return;
+        }
+        Ns_DStringFree(&ds);
+    }
+    ltHandle = ltCfg->maintenancePtr;
+
+    /*
+     * Bound the run with the progress handler of statement timeouts.
+     */
+
+    Ns_GetTime(&start);
+    ltHandle->deadline = start;
+    Ns_IncrTime(&ltHandle->deadline, ltCfg->maintenanceTime / 1000,
+                (ltCfg->maintenanceTime % 1000) * 1000);
+    ltHandle->timedOut = 0;
+    sqlite3_progress_handler(ltHandle->conn, 1000, ProgressHandler, ltHandle);
+
+    if (ltCfg->optimize) {
+        rc = Optimize(ltHandle);
+    }
+    if (rc == SQLITE_OK && ltCfg->vacuumPages > 0
+            && PragmaInt(ltHandle, "PRAGMA auto_vacuum", &mode) == SQLITE_OK
+            && mode == 2) {
+        sql = sqlite3_mprintf("PRAGMA incremental_vacuum(%d)", ltCfg->vacuumPages);
+        while (!ltHandle->timedOut
+               && PragmaInt(ltHandle, "PRAGMA freelist_count", &pages) == SQLITE_OK
+               && pages > 0) {
+            if (ltCfg->file != NULL
+                    && WriteLock(ltHandle, LITE_LOCK_TXN, 1u) != NS_OK) {
+                rc = SQLITE_BUSY;
+                break;
+            }
+            rc = sqlite3_exec(ltHandle->conn, sql, NULL, NULL, NULL);
+            WriteUnlock(ltHandle, LITE_LOCK_TXN);
+            if (rc != SQLITE_OK) {
+                break;
+            }
+            ltHandle->stats.vacuumed += MIN(pages, ltCfg->vacuumPages);
+            Ns_GetTime(&end);
+            if (Ns_DiffTime(&end, &ltHandle->deadline, NULL) > 0) {
+                break;
+            }
+        }
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK && rc != SQLITE_INTERRUPT && rc != SQLITE_BUSY) {
+            ltHandle->stats.errors++;
+            Ns_Log(Error, "dbilite: %s: incremental vacuum failed: %s",
+                   ltCfg->module, sqlite3_errmsg(ltHandle->conn));
+        }
+    }
+
+    sqlite3_progress_handler(ltHandle->conn, 0, NULL, NULL);
+    Ns_GetTime(&end);
+    (void) Ns_DiffTime(&end, &start, &diff);
+    Ns_IncrTime(&ltHandle->stats.maintenanceTime, diff.sec, diff.usec);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Optimize --
+ *
+ *      Run PRAGMA optimize, which analyzes tables whose statistics
+ *      are stale, under the write lock of the pool if any.
+ *
+ * Results:
+ *      The sqlite result code.
+ *
+ * Side effects:
+ *      Errors other than busy or interrupt are logged.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Optimize(LiteHandle *ltHandle)
+{
+    Ns_Time wait;
+    int     rc;
+
+    if (ltHandle->ltCfg->file != NULL
+            && WriteLock(ltHandle, LITE_LOCK_TXN, LITE_SCHEMA_ALL) != NS_OK) {
+        return SQLITE_BUSY;
+    }
+    wait.sec = wait.usec = 0;
+    rc = sqlite3_exec(ltHandle->conn, "PRAGMA optimize", NULL, NULL, NULL);
+    BusyDone(ltHandle, &wait);
+    WriteUnlock(ltHandle, LITE_LOCK_TXN);
+
+    ltHandle->stats.optimizes++;
+    if (rc != SQLITE_OK && rc != SQLITE_INTERRUPT && rc != SQLITE_BUSY) {
+        ltHandle->stats.errors++;
+        Ns_Log(Error, "dbilite: %s: optimize failed: %s",
+               ltHandle->ltCfg->module, sqlite3_errmsg(ltHandle->conn));
+    }
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PragmaInt --
+ *
+ *      Get the integer result of a pragma.
+ *
+ * Results:
+ *      The sqlite result code.
+ *
+ * Side effects:
+ *      The value is left in valuePtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+PragmaInt(LiteHandle *ltHandle, CONST char *sql, int *valuePtr)
+{
+    sqlite3_stmt *st;
+    int           rc;
+
+    rc = sqlite3_prepare_v2(ltHandle->conn, sql, -1, &st, NULL);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_step(st);
+        if (rc == SQLITE_ROW) {
+            *valuePtr = sqlite3_column_int(st, 0);
+            rc = SQLITE_OK;
+        }
+        (void) sqlite3_finalize(st);
+    }
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Authorizer --
+ *
+ *      Note the schemas written by the statement being prepared so
+ *      that it takes the write locks of only those shards, and
+ *      whether it calls a built-in function whose result may change
+ *      while the database doesn't, so that it isn't cached.
+ *
+ * Results:
+ *      Always SQLITE_OK.
+ *
+ * Side effects:
+ *      Adds to the authMask of the handle and sets authVolatile.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Authorizer(void *arg, int action, const char *UNUSED(arg1),
+           const char *arg2, const char *schema,
+           const char *UNUSED(trigger))
+{
+    LiteHandle *ltHandle = arg;
+    LiteConfig *ltCfg = ltHandle->ltCfg;
+    int         i;
+
+    static CONST char *CONST volatileFuncs[] = {
+        "random", "randomblob", "changes", "total_changes",
+        "last_insert_rowid", "date", "time", "datetime", "julianday",
+        "unixepoch", "strftime", "timediff", "current_date",
+        "current_time", "current_timestamp", NULL
+    };
+
+    switch (action) {
+    case SQLITE_FUNCTION:
+        for (i = 0; arg2 != NULL && volatileFuncs[i] != NULL; i++) {
+            if (strcasecmp(arg2, volatileFuncs[i]) == 0) {
+                ltHandle->authVolatile = 1;
+                break;
+            }
+        }
+        return SQLITE_OK;
+    case SQLITE_READ:
+    case SQLITE_SELECT:
+    case SQLITE_RECURSIVE:
+    case SQLITE_TRANSACTION:
+    case SQLITE_SAVEPOINT:
+        return SQLITE_OK;
+    default:
+        break;
+    }
+    if (schema == NULL) {
+        ltHandle->authMask = LITE_SCHEMA_ALL;
+    } else if (strcasecmp(schema, "main") == 0) {
+        ltHandle->authMask |= 1u;
+    } else if (strcasecmp(schema, "temp") != 0) {
+        for (i = 0; i < ltCfg->numShards; i++) {
+            if (strcasecmp(schema, ltCfg->shardNames[i]) == 0) {
+                ltHandle->authMask |= 1u << (i + 1);
+                break;
+            }
+        }
+        if (i == ltCfg->numShards) {
+            ltHandle->authMask = LITE_SCHEMA_ALL;
+        }
+    }
+    return SQLITE_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TraceProfile --
+ *
+ *      Log statements which ran longer than slowquerytime, with their
+ *      bound values and the work sqlite did for them.
+ *
+ * Results:
+ *      Always 0.
+ *
+ * Side effects:
+ *      Resets the statement status counters so that each run is
+ *      reported on its own.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TraceProfile(unsigned int UNUSED(mask), void *arg, void *p, void *x)
+{
+    LiteHandle   *ltHandle = arg;
+    sqlite3_stmt *st = p;
+    sqlite3_int64 nsec = *(sqlite3_int64 *) x;
+    char         *sql;
+    int           fullscan, sort, autoindex, vmstep, reprepare;
+
+    fullscan  = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    sort      = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_SORT, 1);
+    autoindex = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+    vmstep    = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_VM_STEP, 1);
+    reprepare = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_REPREPARE, 1);
+
+    if (nsec >= (sqlite3_int64) ltHandle->ltCfg->slowTime * 1000000) {
+        ltHandle->stats.slow++;
+        sql = sqlite3_expanded_sql(st);
+        Ns_Log(Warning, "dbilite: %s: slow query %.6f seconds"
+               " (fullscan %d sort %d autoindex %d vmstep %d reprepare %d): %s",
+               ltHandle->ltCfg->module, (double) nsec / 1e9,
+               fullscan, sort, autoindex, vmstep, reprepare,
+               sql != NULL ? sql : sqlite3_sql(st));
+        sqlite3_free(sql);
+    }
+    return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PragmaResult --
+ *
+ *      Check the journal mode actually in effect, as sqlite silently
+ *      keeps the old mode if the requested one can't be set.
+ *
+ * Results:
+ *      Always 0, to continue with the next pragma.
+ *
+ * Side effects:
+ *      May log a warning.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+PragmaResult(void *arg, int numCols, char **values, char **names)
+{
+    LiteConfig *ltCfg = arg;
+
+    if (numCols == 1 && values[0] != NULL && ltCfg->journal != NULL
+            && strcmp(names[0], "journal_mode") == 0
+            && strcasecmp(ltCfg->journal, values[0]) != 0) {
+        Ns_Log(Warning, "dbilite: %s: journal_mode is %s, not %s",
+               ltCfg->module, values[0], ltCfg->journal);
+    }
+    return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigChoice --
+ *
+ *      Look up a config key which must be one of the given choices.
+ *
+ * Results:
+ *      Index of the choice, or defChoice if missing or invalid.
+ *
+ * Side effects:
+ *      Invalid values are logged.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ConfigChoice(CONST char *path, CONST char *key,
+             CONST char *CONST *choices, int defChoice)
+{
+    CONST char *value;
+    int         i;
+
+    value = Ns_ConfigGetValue(path, key);
+    if (value == NULL) {
+        return defChoice;
+    }
+    for (i = 0; choices[i] != NULL; i++) {
+        if (strcasecmp(value, choices[i]) == 0) {
+            return i;
+        }
+    }
+    Ns_Log(Error, "dbilite: %s: invalid %s: %s", path, key, value);
+
+    return defChoice;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigBusyMode --
+ *
+ *      Parse the busyhandler config key.
+ *
+ * Results:
+ *      A LITE_BUSY_* strategy, default LITE_BUSY_TIMEOUT.
+ *
+ * Side effects:
+ *      Invalid or unsupported values are logged.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ConfigBusyMode(CONST char *path)
+{
+    int i;
+
+    i = ConfigChoice(path, "busyhandler", busyModes, LITE_BUSY_TIMEOUT);
+#ifndef SQLITE_ENABLE_UNLOCK_NOTIFY
+    if (i == LITE_BUSY_NOTIFY) {
+        Ns_Log(Warning, "dbilite: %s: busyhandler notify not compiled in,"
+               " using backoff", path);
+        return LITE_BUSY_BACKOFF;
+    }
+#endif
+    return i;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BusyHandler --
+ *
+ *      Called by sqlite when a lock is held by another connection.
+ *      Sleep either on the same schedule as sqlite3_busy_timeout(),
+ *      or with exponential backoff and jitter, until the lock is
+ *      free or busytimeout msec have passed.
+ *
+ *      In notify mode this only covers file locks; shared cache
+ *      table locks are waited for in Step().
+ *
+ * Results:
+ *      1 to retry, 0 to give up and return SQLITE_BUSY.
+ *
+ * Side effects:
+ *      Sleeps. The wait is accounted for by BusyDone().
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BusyHandler(void *arg, int count)
+{
+    LiteHandle *ltHandle = arg;
+    LiteConfig *ltCfg    = ltHandle->ltCfg;
+    Ns_Time     now, diff;
+    long        waited;
+    int         delay;
+
+    /*
+     * A count of 0 starts a new wait, even if the last one was in a
+     * call such as sqlite3_exec() which BusyDone() didn't follow.
+     */
+
+    Ns_GetTime(&now);
+    if (!ltHandle->busy || count == 0) {
+        ltHandle->busy = 1;
+        ltHandle->busyStart = now;
+    }
+    (void) Ns_DiffTime(&now, &ltHandle->busyStart, &diff);
+    waited = diff.sec * 1000 + diff.usec / 1000;
+
+    if (waited >= ltCfg->busyTimeout
+            || (ltCfg->retries > 0 && count >= ltCfg->retries)) {
+        return 0;
+    }
+
+    if (ltCfg->busyMode == LITE_BUSY_TIMEOUT) {
+        delay = busyDelays[MIN(count, NUM_BUSY_DELAYS - 1)];
+    } else {
+        delay = ltCfg->backoffMax;
+        if (count < 16 && ltCfg->backoffMin <= (ltCfg->backoffMax >> count)) {
+            delay = ltCfg->backoffMin << count;
+        }
+        delay = delay / 2 + (int)(Ns_DRand() * (delay / 2 + 1));
+    }
+    delay = (int) MIN((long) delay, ltCfg->busyTimeout - waited);
+
+    (void) sqlite3_sleep(MAX(delay, 1));
+
+    return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BusyDone --
+ *
+ *      Account for time spent in BusyHandler() during the last call
+ *      to sqlite3_step().
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Wait time is added to waitPtr and the handle stats.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+BusyDone(LiteHandle *ltHandle, Ns_Time *waitPtr)
+{
+    Ns_Time now, diff;
+
+    if (ltHandle->busy) {
+        ltHandle->busy = 0;
+        Ns_GetTime(&now);
+        (void) Ns_DiffTime(&now, &ltHandle->busyStart, &diff);
+        Ns_IncrTime(waitPtr, diff.sec, diff.usec);
+        Ns_IncrTime(&ltHandle->stats.busyWait, diff.sec, diff.usec);
+        ltHandle->stats.busy++;
+    }
+}
+
+
+#ifdef SQLITE_ENABLE_UNLOCK_NOTIFY
+
+/*
+ * The following structure is signalled by UnlockNotify().
+ */
+
+typedef struct UnlockWait {
+    int      fired;
+    Ns_Mutex lock;
+    Ns_Cond  cond;
+} UnlockWait;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WaitForUnlockNotify --
+ *
+ *      Block until the connection holding the shared cache lock
+ *      which caused SQLITE_LOCKED commits, or busytimeout passes.
+ *
+ * Results:
+ *      SQLITE_OK if the statement should be retried, SQLITE_LOCKED
+ *      on deadlock or timeout.
+ *
+ * Side effects:
+ *      The wait is accounted for by BusyDone().
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WaitForUnlockNotify(LiteHandle *ltHandle)
+{
+    UnlockWait wait;
+    Ns_Time    timeout;
+    int        rc, status = NS_OK;
+
+    wait.fired = 0;
+    Ns_MutexInit(&wait.lock);
+    Ns_CondInit(&wait.cond);
+
+    ltHandle->busy = 1;
+    Ns_GetTime(&ltHandle->busyStart);
+
+    rc = sqlite3_unlock_notify(ltHandle->conn, UnlockNotify, &wait);
+    if (rc == SQLITE_OK) {
+        timeout = ltHandle->busyStart;
+        Ns_IncrTime(&timeout, 0, (long) ltHandle->ltCfg->busyTimeout * 1000);
+        Ns_MutexLock(&wait.lock);
+        while (!wait.fired && status == NS_OK) {
+            status = Ns_CondTimedWait(&wait.cond, &wait.lock, &timeout);
+        }
+        Ns_MutexUnlock(&wait.lock);
+
+        /*
+         * NB: Cancel, as wait is about to go out of scope. sqlite calls
+         * UnlockNotify() holding the mutex taken here, so once this
+         * returns it is done with wait.
+         */
+
+        (void) sqlite3_unlock_notify(ltHandle->conn, NULL, NULL);
+        Ns_MutexLock(&wait.lock);
+        if (!wait.fired) {
+            rc = SQLITE_LOCKED;
+        }
+        Ns_MutexUnlock(&wait.lock);
+    }
+
+    Ns_CondDestroy(&wait.cond);
+    Ns_MutexDestroy(&wait.lock);
+
+    return rc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UnlockNotify --
+ *
+ *      Wake the threads blocked in WaitForUnlockNotify().
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+UnlockNotify(void **args, int numArgs)
+{
+    UnlockWait *wait;
+    int         i;
+
+    for (i = 0; i < numArgs; i++) {
+        wait = args[i];
+        Ns_MutexLock(&wait->lock);
+        wait->fired = 1;
+        Ns_CondBroadcast(&wait->cond);
+        Ns_MutexUnlock(&wait->lock);
+    }
+}
+
+#endif /* SQLITE_ENABLE_UNLOCK_NOTIFY */
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigProcess --
+ *
+ *      Select the multi-thread threading mode, route sqlite
+ *      allocations through ns_malloc and give sqlite a preallocated
+ *      page cache, if configured. These apply to the whole process
+ *      and only take effect in the first pool loaded, before sqlite
+ *      is initialized.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Logs a warning if sqlite was already initialized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ConfigProcess(CONST char *path)
+{
+    static sqlite3_mem_methods methods = {
+        MemMalloc, MemFree, MemRealloc, MemSize, MemRoundup,
+        MemInit, MemShutdown, NULL
+    };
+    void *buf;
+    int   pages, pageSize, hdrSize = 0;
+
+    if (Ns_ConfigBool(path, "multithread", NS_FALSE)
+            && sqlite3_config(SQLITE_CONFIG_MULTITHREAD) != SQLITE_OK) {
+        Ns_Log(Warning, "dbilite: %s: multithread ignored, sqlite already"
+               " initialized", path);
+    }
+    if (Ns_ConfigBool(path, "nsmalloc", NS_FALSE)
+            && sqlite3_config(SQLITE_CONFIG_MALLOC, &methods) != SQLITE_OK) {
+        Ns_Log(Warning, "dbilite: %s: nsmalloc ignored, sqlite already"
+               " initialized", path);
+    }
+
+    pages = Ns_ConfigIntRange(path, "pagecachepages", 0, 0, INT_MAX);
+    pageSize = Ns_ConfigIntRange(path, "pagecachepagesize", 4096, 512, 65536);
+    if (pages > 0) {
+        (void) sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &hdrSize);
+        buf = ns_malloc((size_t) pages * (size_t) (pageSize + hdrSize));
+        if (sqlite3_config(SQLITE_CONFIG_PAGECACHE, buf,
+                           pageSize + hdrSize, pages) != SQLITE_OK) {
+            Ns_Log(Warning, "dbilite: %s: pagecachepages ignored, sqlite"
+                   " already initialized", path);
+            ns_free(buf);
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemMalloc, MemFree, MemRealloc, MemSize, MemRoundup, MemInit,
+ * MemShutdown --
+ *
+ *      sqlite3_mem_methods over ns_malloc. Each allocation is
+ *      preceded by its size, which sqlite needs to know.
+ *
+ * Results:
+ *      See sqlite3_mem_methods.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void *
+MemMalloc(int size)
+{
+    sqlite3_int64 *p = ns_malloc((size_t) size + sizeof(sqlite3_int64));
+
+    if (p == NULL) {
+        return NULL;
+    }
+    p[0] = size;
+    return p + 1;
+}
+
+static void
+MemFree(void *ptr)
+{
+    ns_free((sqlite3_int64 *) ptr - 1);
+}
+
+static void *
+MemRealloc(void *ptr, int size)
+{
+    sqlite3_int64 *p = (sqlite3_int64 *) ptr - 1;
+
+    p = ns_realloc(p, (size_t) size + sizeof(sqlite3_int64));
+    if (p == NULL) {
+        return NULL;
+    }
+    p[0] = size;
+    return p + 1;
+}
+
+static int
+MemSize(void *ptr)
+{
+    return ptr == NULL ? 0 : (int) ((sqlite3_int64 *) ptr)[-1];
+}
+
+static int
+MemRoundup(int size)
+{
+    return (size + 7) & ~7;
+}
+
+static int
+MemInit(void *UNUSED(arg))
+{
+    return SQLITE_OK;
+}
+
+static void
+MemShutdown(void *UNUSED(arg))
+{
+    return;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigOpenFlags --
+ *
+ *      Get the flags for sqlite3_open_v2() from the openflags list,
+ *      default nomutex as a handle is only used by one thread at a
+ *      time, and readonly.
+ *
+ * Results:
+ *      SQLITE_OPEN_* flags.
+ *
+ * Side effects:
+ *      Logs unknown flags.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ConfigOpenFlags(CONST char *path)
+{
+    CONST char  *value, **argv;
+    int          argc, flags = SQLITE_OPEN_URI, i, j;
+
+    value = Ns_ConfigGetValue(path, "openflags");
+    if (value == NULL) {
+        value = "nomutex";
+    }
+    if (Tcl_SplitList(NULL, value, &argc, &argv) != TCL_OK) {
+        Ns_Log(Error, "dbilite: %s: invalid openflags: %s", path, value);
+        argc = 0;
+        argv = NULL;
+    }
+    for (i = 0; i < argc; i++) {
+        for (j = 0; openFlags[j].name != NULL; j++) {
+            if (strcasecmp(argv[i], openFlags[j].name) == 0) {
+                flags |= openFlags[j].flag;
+                break;
+            }
+        }
+        if (openFlags[j].name == NULL) {
+            Ns_Log(Error, "dbilite: %s: invalid openflags: %s", path, argv[i]);
+        }
+    }
+    if (argv != NULL) {
+        Tcl_Free((char *) argv);
+    }
+    if ((flags & SQLITE_OPEN_FULLMUTEX)) {
+        flags &= ~SQLITE_OPEN_NOMUTEX;
+    }
+    if ((flags & SQLITE_OPEN_SHAREDCACHE)) {
+        flags &= ~SQLITE_OPEN_PRIVATECACHE;
+    }
+    if ((flags & SQLITE_OPEN_READONLY) || Ns_ConfigBool(path, "readonly", NS_FALSE)
+            || Ns_ConfigBool(path, "immutable", NS_FALSE)) {
+        flags |= SQLITE_OPEN_READONLY;
+    } else {
+        flags |= SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    }
+    return flags;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigHeapLimits --
+ *
+ *      Set the sqlite heap limits, which apply to the whole process,
+ *      if configured for this pool.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Overrides limits set by pools loaded earlier.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ConfigHeapLimits(CONST char *path)
+{
+    int kbytes;
+
+    kbytes = Ns_ConfigIntRange(path, "softheaplimit", 0, 0, INT_MAX);
+    if (kbytes > 0) {
+        (void) sqlite3_soft_heap_limit64((sqlite3_int64) kbytes * 1024);
+    }
+    kbytes = Ns_ConfigIntRange(path, "hardheaplimit", 0, 0, INT_MAX);
+    if (kbytes > 0) {
+        (void) sqlite3_hard_heap_limit64((sqlite3_int64) kbytes * 1024);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigDatasource --
+ *
+ *      Get the datasource of a pool. With sharedmemory or replica,
+ *      all handles of the pool open the same database in the memdb
+ *      vfs, named after the datasource or the pool if it is :memory:.
+ *      The name must start with a slash for the database to be shared.
+ *      Immutable files are opened as a URI with immutable=1, so sqlite
+ *      neither locks them nor checks them for changes.
+ *
+ * Results:
+ *      Filename or URI for sqlite3_open_v2().
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CONST char *
+ConfigDatasource(CONST char *path, CONST char *module)
+{
+    CONST char *datasource;
+    Ns_DString  ds;
+
+    datasource = Ns_ConfigString(path, "datasource", ":memory:");
+    if (Ns_ConfigBool(path, "immutable", NS_FALSE)
+            && *datasource != '\0' && strcmp(datasource, ":memory:") != 0) {
+        Ns_DStringInit(&ds);
+        if (strncmp(datasource, "file:", 5) == 0) {
+            Ns_DStringVarAppend(&ds, datasource,
+                                strchr(datasource, '?') != NULL ? "&" : "?",
+                                "immutable=1&mode=ro", NULL);
+        } else {
+            Ns_DStringAppend(&ds, "file:");
+            AppendUriPath(&ds, datasource);
+            Ns_DStringAppend(&ds, "?immutable=1&mode=ro");
+        }
+        return Ns_DStringExport(&ds);
+    }
+    if (!Ns_ConfigBool(path, "sharedmemory", NS_FALSE)
+            && !Ns_ConfigBool(path, "replica", NS_FALSE)) {
+        return datasource;
+    }
+    if (*datasource == '\0' || strcmp(datasource, ":memory:") == 0) {
+        datasource = module;
+    }
+    Ns_DStringInit(&ds);
+    Ns_DStringAppend(&ds, *datasource == '/' ? "file:" : "file:/");
+    AppendUriPath(&ds, datasource);
+    Ns_DStringAppend(&ds, "?vfs=memdb");
+
+    return Ns_DStringExport(&ds);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendUriPath --
+ *
+ *      Append a file path to a URI, escaping the characters which
+ *      would otherwise start the query or fragment or an escape.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendUriPath(Ns_DString *dsPtr, CONST char *path)
+{
+    CONST char *p;
+
+    for (p = path; *p != '\0'; p++) {
+        if (*p == '?' || *p == '#' || *p == '%') {
+            Ns_DStringPrintf(dsPtr, "%%%02X", UCHAR(*p));
+        } else {
+            Ns_DStringNAppend(dsPtr, p, 1);
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigShards --
+ *
+ *      Get the databases attached to each handle from the shard
+ *      entries, each a schema name and a datasource.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Logs invalid entries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ConfigShards(LiteConfig *ltCfg, CONST char *path)
+{
+    Ns_Set      *set;
+    CONST char **argv;
+    size_t       i;
+    int          argc, n = 0;
+
+    set = Ns_ConfigGetSection(path);
+    for (i = 0u; set != NULL && i < Ns_SetSize(set); i++) {
+        if (strcasecmp(Ns_SetKey(set, i), "shard") == 0) {
+            n++;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    ltCfg->shardNames = ns_calloc((size_t) n, sizeof(char *));
+    ltCfg->shardPaths = ns_calloc((size_t) n, sizeof(char *));
+
+    for (i = 0u; i < Ns_SetSize(set); i++) {
+        if (strcasecmp(Ns_SetKey(set, i), "shard") != 0) {
+            continue;
+        }
+        if (Tcl_SplitList(NULL, Ns_SetValue(set, i), &argc, &argv) != TCL_OK) {
+            argc = 0;
+            argv = NULL;
+        }
+        if (argc != 2 || ltCfg->numShards >= LITE_MAX_SHARDS) {
+            Ns_Log(Error, "dbilite: %s: invalid shard: %s",
+                   path, Ns_SetValue(set, i));
+        } else {
+            ltCfg->shardNames[ltCfg->numShards] = ns_strdup(argv[0]);
+            ltCfg->shardPaths[ltCfg->numShards] = ns_strdup(argv[1]);
+            ltCfg->numShards++;
+        }
+        if (argv != NULL) {
+            Tcl_Free((char *) argv);
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigExtensions --
+ *
+ *      Get the sqlite extensions loaded by each handle from the
+ *      extension entries, each a path and an optional entry point.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Logs invalid entries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ConfigExtensions(LiteConfig *ltCfg, CONST char *path)
+{
+    Ns_Set      *set;
+    CONST char **argv;
+    size_t       i;
+    int          argc, n = 0;
+
+    set = Ns_ConfigGetSection(path);
+    for (i = 0u; set != NULL && i < Ns_SetSize(set); i++) {
+        if (strcasecmp(Ns_SetKey(set, i), "extension") == 0) {
+            n++;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    ltCfg->extensions  = ns_calloc((size_t) n, sizeof(char *));
+    ltCfg->entryPoints = ns_calloc((size_t) n, sizeof(char *));
+
+    for (i = 0u; i < Ns_SetSize(set); i++) {
+        if (strcasecmp(Ns_SetKey(set, i), "extension") != 0) {
+            continue;
+        }
+        if (Tcl_SplitList(NULL, Ns_SetValue(set, i), &argc, &argv) != TCL_OK) {
+            argc = 0;
+            argv = NULL;
+        }
+        if (argc < 1 || argc > 2) {
+            Ns_Log(Error, "dbilite: %s: invalid extension: %s",
+                   path, Ns_SetValue(set, i));
+        } else {
+            ltCfg->extensions[ltCfg->numExtensions] = ns_strdup(argv[0]);
+            ltCfg->entryPoints[ltCfg->numExtensions] =
+                argc > 1 ? ns_strdup(argv[1]) : NULL;
+            ltCfg->numExtensions++;
+        }
+        if (argv != NULL) {
+            Tcl_Free((char *) argv);
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoadExtensions --
+ *
+ *      Load the configured extensions into a new connection. Loading
+ *      is enabled for the C API only, and only while doing so, so
+ *      that queries can't load_extension() themselves.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR with the error message left in dsPtr.
+ *
+ * Side effects:
+ *      Extensions register their functions, collations or modules.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+LoadExtensions(LiteHandle *ltHandle, Ns_DString *dsPtr)
+{
+    LiteConfig *ltCfg = ltHandle->ltCfg;
+    char       *errmsg = NULL;
+    int         i, status = NS_OK;
+
+    (void) sqlite3_db_config(ltHandle->conn, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION,
+                             1, NULL);
+    for (i = 0; i < ltCfg->numExtensions; i++) {
+        if (sqlite3_load_extension(ltHandle->conn, ltCfg->extensions[i],
+                                   ltCfg->entryPoints[i], &errmsg) != SQLITE_OK) {
+            Ns_DStringPrintf(dsPtr, "dbilite: error loading extension %s: %s",
+                             ltCfg->extensions[i],
+                             errmsg != NULL ? errmsg : sqlite3_errmsg(ltHandle->conn));
+            sqlite3_free(errmsg);
+            status = NS_ERROR;
+            break;
+        }
+    }
+    (void) sqlite3_db_config(ltHandle->conn, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION,
+                             0, NULL);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RegexpFunc --
+ *
+ *      Implements the SQL function regexp(pattern, string) behind the
+ *      REGEXP operator, with Tcl advanced regular expressions. The
+ *      compiled pattern is kept for the rest of the statement.
+ *
+ * Results:
+ *      1 if the string matches, 0 if not, or null if either is null.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RegexpFunc(sqlite3_context *ctx, int UNUSED(argc), sqlite3_value **argv)
+{
+    Tcl_Obj    *patObj;
+    Tcl_RegExp  re;
+    CONST char *string;
+    int         rc;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL
+            || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        return;
+    }
+    patObj = sqlite3_get_auxdata(ctx, 0);
+    if (patObj == NULL) {
+        patObj = Tcl_NewStringObj((CONST char *) sqlite3_value_text(argv[0]),
+                                  sqlite3_value_bytes(argv[0]));
+        Tcl_IncrRefCount(patObj);
+        sqlite3_set_auxdata(ctx, 0, patObj, FreeObj);
+        if (sqlite3_get_auxdata(ctx, 0) == NULL) {
+            sqlite3_result_error_nomem(ctx);
+            return;
+        }
+    }
+    re = Tcl_GetRegExpFromObj(NULL, patObj, TCL_REG_ADVANCED);
+    if (re == NULL) {
+        sqlite3_result_error(ctx, "invalid regular expression", -1);
+        return;
+    }
+    string = (CONST char *) sqlite3_value_text(argv[1]);
+    rc = Tcl_RegExpExec(NULL, re, string, string);
+    if (rc < 0) {
+        sqlite3_result_error(ctx, "regular expression match failed", -1);
+        return;
+    }
+    sqlite3_result_int(ctx, rc);
+}
+
+static void
+FreeObj(void *arg)
+{
+    Tcl_Obj *objPtr = arg;
+
+    Tcl_DecrRefCount(objPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LevenshteinFunc --
+ *
+ *      Implements the SQL function levenshtein(a, b): the number of
+ *      characters inserted, deleted or substituted to turn a into b,
+ *      e.g. to rank fuzzy matches.
+ *
+ * Results:
+ *      The edit distance, or null if either is null.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+LevenshteinFunc(sqlite3_context *ctx, int UNUSED(argc), sqlite3_value **argv)
+{
+    Tcl_DString  ds1, ds2;
+    Tcl_UniChar *a, *b;
+    int         *row, len1, len2, i, j, prev, cur;
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL
+            || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        return;
+    }
+    a = Tcl_UtfToUniCharDString((CONST char *) sqlite3_value_text(argv[0]),
+                                sqlite3_value_bytes(argv[0]), &ds1);
+    b = Tcl_UtfToUniCharDString((CONST char *) sqlite3_value_text(argv[1]),
+                                sqlite3_value_bytes(argv[1]), &ds2);
+    len1 = Tcl_DStringLength(&ds1) / (int) sizeof(Tcl_UniChar);
+    len2 = Tcl_DStringLength(&ds2) / (int) sizeof(Tcl_UniChar);
+
+    /*
+     * One row of the distance matrix, updated in place.
+     */
+
+    row = ns_malloc((size_t) (len2 + 1) * sizeof(int));
+    for (j = 0; j <= len2; j++) {
+        row[j] = j;
+    }
+    for (i = 1; i <= len1; i++) {
+        prev = row[0];
+        row[0] = i;
+        for (j = 1; j <= len2; j++) {
+            cur = row[j];
+            row[j] = MIN(MIN(row[j] + 1, row[j - 1] + 1),
+                         prev + (a[i - 1] == b[j - 1] ? 0 : 1));
+            prev = cur;
+        }
+    }
+    sqlite3_result_int(ctx, row[len2]);
+
+    ns_free(row);
+    Tcl_DStringFree(&ds1);
+    Tcl_DStringFree(&ds2);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConfigList --
+ *
+ *      Get the values of all entries of a repeated key.
+ *
+ * Results:
+ *      Array of values, or NULL if none.
+ *
+ * Side effects:
+ *      The number of values is left in numPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CONST char **
+ConfigList(CONST char *path, CONST char *key, int *numPtr)
+{
+    Ns_Set      *set;
+    CONST char **values = NULL;
+    size_t       i;
+    int          n = 0;
+
+    set = Ns_ConfigGetSection(path);
+    for (i = 0u; set != NULL && i < Ns_SetSize(set); i++) {
+        if (strcasecmp(Ns_SetKey(set, i), key) == 0) {
+            n++;
+        }
+    }
+    if (n > 0) {
+        values = ns_calloc((size_t) n, sizeof(char *));
+        n = 0;
+        for (i = 0u; i < Ns_SetSize(set); i++) {
+            if (strcasecmp(Ns_SetKey(set, i), key) == 0) {
+                values[n++] = ns_strdup(Ns_SetValue(set, i));
+            }
+        }
+    }
+    *numPtr = n;
+
+    return values;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Warm --
+ *
+ *      Open openhandles connections in parallel for Open() to use, so
+ *      that the first requests after startup don't wait for the file
+ *      to be opened, the schema parsed and statements prepared. The
+ *      first also runs the warmquery statements and reads the file if
+ *      warmfile is set, to bring its pages into the OS page cache.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Blocks startup until done.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Warm(LiteConfig *ltCfg, CONST char *path)
+{
+    LiteWarm   *warms;
+    LiteHandle *ltHandle;
+    Ns_Time     start, end, diff;
+    int         i, n = 0;
+
+    ltCfg->openHandles = Ns_ConfigIntRange(path, "openhandles", 0, 0, 1024);
+    if (ltCfg->maxHandles > 0) {
+        ltCfg->openHandles = MIN(ltCfg->openHandles, ltCfg->maxHandles);
+    }
+    ltCfg->warmQueries = ConfigList(path, "warmquery", &ltCfg->numWarmQueries);
+    ltCfg->warmFile    = Ns_ConfigBool(path, "warmfile", NS_FALSE);
+    if (ltCfg->openHandles == 0
+            && ltCfg->numWarmQueries == 0 && !ltCfg->warmFile) {
+        return;
+    }
+
+    /*
+     * Warm pages on a connection of its own if none are kept.
+     */
+
+    Ns_GetTime(&start);
+    warms = ns_calloc((size_t) MAX(ltCfg->openHandles, 1), sizeof(LiteWarm));
+    for (i = 0; i < MAX(ltCfg->openHandles, 1); i++) {
+        warms[i].ltCfg = ltCfg;
+        warms[i].first = (i == 0);
+        Ns_ThreadCreate(WarmThread, &warms[i], 0, &warms[i].thread);
+    }
+    for (i = 0; i < MAX(ltCfg->openHandles, 1); i++) {
+        Ns_ThreadJoin(&warms[i].thread, NULL);
+    }
+    ns_free(warms);
+
+    if (ltCfg->openHandles == 0) {
+        Ns_MutexLock(&ltCfg->lock);
+        ltHandle = ltCfg->sparePtr;
+        ltCfg->sparePtr = NULL;
+        Ns_MutexUnlock(&ltCfg->lock);
+        if (ltHandle != NULL) {
+            FreeHandle(ltHandle);
+        }
+    }
+    Ns_MutexLock(&ltCfg->lock);
+    for (ltHandle = ltCfg->sparePtr; ltHandle != NULL; ltHandle = ltHandle->nextPtr) {
+        n++;
+    }
+    Ns_MutexUnlock(&ltCfg->lock);
+
+    Ns_GetTime(&end);
+    (void) Ns_DiffTime(&end, &start, &diff);
+    Ns_Log(Notice, "dbilite: %s: opened %d handles and warmed in %ld.%06ld sec",
+           ltCfg->module, n, (long) diff.sec, (long) diff.usec);
+}
+
+static void
+WarmThread(void *arg)
+{
+    LiteWarm   *warmPtr = arg;
+    LiteConfig *ltCfg = warmPtr->ltCfg;
+    LiteHandle *ltHandle;
+    Ns_DString  ds;
+
+    Ns_ThreadSetName("-dbilite:warm-");
+
+    Ns_DStringInit(&ds);
+    ltHandle = NewHandle(ltCfg, &ds);
+    if (ltHandle == NULL) {
+        Ns_Log(Error, "dbilite: %s: could not open handle at startup: %s",
+               ltCfg->module, Ns_DStringValue(&ds));
+        Ns_DStringFree(&ds);
+        return;
+    }
+    Ns_DStringFree(&ds);
+
+    /*
+     * Prewarm prepares statements, which also parses the schema.
+     */
+
+    if (ltCfg->prewarm != NULL) {
+        Prewarm(ltHandle);
+    } else {
+        (void) sqlite3_exec(ltHandle->conn, "SELECT 1 FROM sqlite_master LIMIT 1",
+                            NULL, NULL, NULL);
+    }
+    if (warmPtr->first) {
+        WarmPages(ltHandle);
+    }
+    SampleMemory(ltHandle);
+
+    Ns_MutexLock(&ltCfg->lock);
+    ltHandle->nextPtr = ltCfg->sparePtr;
+    ltCfg->sparePtr = ltHandle;
+    Ns_MutexUnlock(&ltCfg->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WarmPages --
+ *
+ *      Run the warmquery statements to completion and read the main
+ *      database file through, if warmfile is set.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Errors are logged.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WarmPages(LiteHandle *ltHandle)
+{
+    LiteConfig   *ltCfg = ltHandle->ltCfg;
+    sqlite3_stmt *st;
+    Tcl_Channel   chan;
+    CONST char   *file;
+    char         *buf;
+    int           i, rc;
+
+    for (i = 0; i < ltCfg->numWarmQueries; i++) {
+        rc = sqlite3_prepare_v2(ltHandle->conn, ltCfg->warmQueries[i], -1, &st, NULL);
+        if (rc == SQLITE_OK && st != NULL) {
+            while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+                continue;
+            }
+            if (rc == SQLITE_DONE) {
+                rc = SQLITE_OK;
+            }
+        }
+        if (rc != SQLITE_OK) {
+            Ns_Log(Warning, "dbilite: %s: warmquery failed: %s: %s",
+                   ltCfg->module, sqlite3_errmsg(ltHandle->conn),
+                   ltCfg->warmQueries[i]);
+        }
+        (void) sqlite3_finalize(st);
+    }
+
+    file = sqlite3_db_filename(ltHandle->conn, "main");
+    if (ltCfg->warmFile && file != NULL && *file != '\0') {
+        chan = Tcl_OpenFileChannel(NULL, file, "r", 0);
+        if (chan == NULL) {
+            Ns_Log(Warning, "dbilite: %s: could not read %s: %s",
+                   ltCfg->module, file, strerror(Tcl_GetErrno()));
+            return;
+        }
+        (void) Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+        buf = ns_malloc(1024u * 1024u);
+        while (Tcl_Read(chan, buf, 1024 * 1024) > 0) {
+            continue;
+        }
+        ns_free(buf);
+        (void) Tcl_Close(NULL, chan);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetFile --
+ *
+ *      Find or create the write lock for a datasource. Private
+ *      :memory: databases need no lock.
+ *
+ * Results:
+ *      Pointer to LiteFile or NULL.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static LiteFile *
+GetFile(CONST char *datasource)
+{
+    static int     initialized = 0;
+    LiteFile      *file = NULL;
+    Tcl_HashEntry *hPtr;
+    int            isNew;
+
+    if (*datasource == '\0' || strcmp(datasource, ":memory:") == 0) {
+        return NULL;
+    }
+
+    Ns_MutexLock(&filesLock);
+    if (!initialized) {
+        Tcl_InitHashTable(&files, TCL_STRING_KEYS);
+        initialized = 1;
+    }
+    hPtr = Tcl_CreateHashEntry(&files, datasource, &isNew);
+    if (isNew) {
+        file = ns_calloc(1, sizeof(LiteFile));
+        Ns_MutexInit(&file->lock);
+        Ns_MutexSetName2(&file->lock, "dbilite:write", datasource);
+        Ns_CondInit(&file->cond);
+        Tcl_InitHashTable(&file->skipped, TCL_ONE_WORD_KEYS);
+        Tcl_SetHashValue(hPtr, file);
+    } else {
+        file = Tcl_GetHashValue(hPtr);
+    }
+    Ns_MutexUnlock(&filesLock);
+
+    return file;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriteLock, WriteUnlock, SchemaFile --
+ *
+ *      Acquire or release the write locks for the pool's datasource
+ *      and the shards in the mask. Writers queue and are served in
+ *      order of arrival rather than racing each other in the sqlite
+ *      busy handler.
+ *
+ * Results:
+ *      WriteLock: NS_OK, or NS_ERROR if the locks weren't all free
+ *      within busytimeout msec.
+ *
+ * Side effects:
+ *      WriteLock blocks until earlier writers are done, and on error
+ *      releases what it got. WriteUnlock is a no-op unless the lock
+ *      is held in the given mode.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WriteLock(LiteHandle *ltHandle, int mode, unsigned int mask)
+{
+    LiteConfig    *ltCfg = ltHandle->ltCfg;
+    LiteFile      *file;
+    unsigned long  ticket;
+    Ns_Time        start, timeout, now, diff;
+    int            i, isNew, waited = 0, status = NS_OK;
+
+    assert(ltCfg->file != NULL);
+    assert(ltHandle->writeLock == LITE_LOCK_NONE);
+
+    Ns_GetTime(&start);
+    timeout = start;
+    Ns_IncrTime(&timeout, 0, (long) ltCfg->busyTimeout * 1000);
+
+    /*
+     * Take the locks in schema order so that writers to several
+     * shards can't deadlock. A writer which gives up leaves its
+     * ticket to be skipped by WriteUnlock.
+     */
+
+    for (i = 0; i <= ltCfg->numShards && status == NS_OK; i++) {
+        if ((mask & (1u << i)) == 0u || (file = SchemaFile(ltCfg, i)) == NULL) {
+            continue;
+        }
+        Ns_MutexLock(&file->lock);
+        ticket = file->next++;
+        while (ticket != file->serving) {
+            waited = 1;
+            if (Ns_CondTimedWait(&file->cond, &file->lock, &timeout) == NS_TIMEOUT
+                    && ticket != file->serving) {
+                (void) Tcl_CreateHashEntry(&file->skipped, (char *) ticket, &isNew);
+                status = NS_ERROR;
+                break;
+            }
+        }
+        if (status == NS_OK) {
+            file->owner = Ns_ThreadId();
+        }
+        Ns_MutexUnlock(&file->lock);
+        if (status == NS_OK) {
+            ltHandle->writeMask |= 1u << i;
+        }
+    }
+
+    if (waited) {
+        Ns_GetTime(&now);
+        (void) Ns_DiffTime(&now, &start, &diff);
+        Ns_IncrTime(&ltHandle->stats.lockWait, diff.sec, diff.usec);
+    }
+    ltHandle->writeLock = mode;
+    if (status != NS_OK) {
+        WriteUnlock(ltHandle, mode);
+    }
+    return status;
+}
+
+static void
+WriteUnlock(LiteHandle *ltHandle, int mode)
+{
+    LiteFile      *file;
+    Tcl_HashEntry *hPtr;
+    int            i;
+
+    if (ltHandle->writeLock == mode && mode != LITE_LOCK_NONE) {
+        ltHandle->writeLock = LITE_LOCK_NONE;
+        for (i = 0; i <= ltHandle->ltCfg->numShards; i++) {
+            if ((ltHandle->writeMask & (1u << i)) == 0u
+                    || (file = SchemaFile(ltHandle->ltCfg, i)) == NULL) {
+                continue;
+            }
+            Ns_MutexLock(&file->lock);
+            file->owner = 0u;
+            file->serving++;
+            while ((hPtr = Tcl_FindHashEntry(&file->skipped,
+                                             (char *) file->serving)) != NULL) {
+                Tcl_DeleteHashEntry(hPtr);
+                file->serving++;
+            }
+            Ns_CondBroadcast(&file->cond);
+            Ns_MutexUnlock(&file->lock);
+        }
+        ltHandle->writeMask = 0u;
+    }
+}
+
+static LiteFile *
+SchemaFile(LiteConfig *ltCfg, int schema)
+{
+    if (schema == 0) {
+        return ltCfg->file;
+    }
+    return ltCfg->shardFiles != NULL ? ltCfg->shardFiles[schema - 1] : NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RegisterPool --
+ *
+ *      Make the pool available to the driver commands, and create the
+ *      commands in the interps of the pool's server.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Global pools are reachable by name from the commands of any
+ *      server with a private dbilite pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RegisterPool(LiteConfig *ltCfg)
+{
+    static int     initialized = 0;
+    Tcl_HashEntry *hPtr;
+    int            isNew = 0;
+
+    Ns_MutexLock(&poolsLock);
+    if (!initialized) {
+        Tcl_InitHashTable(&pools, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&servers, TCL_STRING_KEYS);
+        byteArrayTypePtr = Tcl_GetObjType("bytearray");
+        Ns_TlsAlloc(&timeoutTls, NULL);
+#ifdef SQLITE_ENABLE_SNAPSHOT
+        Ns_TlsAlloc(&snapshotTls, NULL);
+        Tcl_InitHashTable(&snapshots, TCL_STRING_KEYS);
+#endif
+        initialized = 1;
+    }
+    hPtr = Tcl_CreateHashEntry(&pools, ltCfg->module, &isNew);
+    Tcl_SetHashValue(hPtr, ltCfg);
+    if (ltCfg->server != NULL) {
+        (void) Tcl_CreateHashEntry(&servers, ltCfg->server, &isNew);
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    if (ltCfg->server != NULL && isNew) {
+        (void) Ns_TclRegisterTrace(ltCfg->server, InitInterp, ltCfg->server,
+                                   NS_TCL_TRACE_CREATE);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitInterp --
+ *
+ *      Create the driver commands.
+ *
+ * Results:
+ *      TCL_OK.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+InitInterp(Tcl_Interp *interp, const void *arg)
+{
+    int i;
+
+    for (i = 0; cmds[i].name != NULL; i++) {
+        (void) Tcl_CreateObjCommand(interp, cmds[i].name, cmds[i].proc,
+                                    (ClientData) arg, NULL);
+    }
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetPool --
+ *
+ *      Find a pool by name, or the server's default pool if name
+ *      is NULL.
+ *
+ * Results:
+ *      Pointer to LiteConfig, or NULL with an error left in interp.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static LiteConfig *
+GetPool(Tcl_Interp *interp, CONST char *server, CONST char *pool)
+{
+    LiteConfig     *ltCfg = NULL;
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+
+    Ns_MutexLock(&poolsLock);
+    if (pool != NULL) {
+        hPtr = Tcl_FindHashEntry(&pools, pool);
+        if (hPtr != NULL) {
+            ltCfg = Tcl_GetHashValue(hPtr);
+            if (ltCfg->server != NULL && strcmp(ltCfg->server, server) != 0) {
+                ltCfg = NULL;
+            }
+        }
+    } else {
+        hPtr = Tcl_FirstHashEntry(&pools, &search);
+        while (hPtr != NULL) {
+            ltCfg = Tcl_GetHashValue(hPtr);
+            if (ltCfg->isDefault
+                    && ltCfg->server != NULL && strcmp(ltCfg->server, server) == 0) {
+                break;
+            }
+            ltCfg = NULL;
+            hPtr = Tcl_NextHashEntry(&search);
+        }
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    if (ltCfg == NULL) {
+        if (pool != NULL) {
+            Ns_TclPrintfResult(interp, "invalid dbilite pool: %s", pool);
+        } else {
+            Ns_TclPrintfResult(interp, "no default dbilite pool for server: %s",
+                               server);
+        }
+    }
+    return ltCfg;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetAux, PutAux --
+ *
+ *      Get an idle connection to the pool's datasource for the
+ *      driver commands, opening a new one if none is idle, and
+ *      return it when done.
+ *
+ * Results:
+ *      GetAux: pointer to LiteHandle, or NULL with an error left in
+ *      interp.
+ *
+ * Side effects:
+ *      Aux connections are opened on demand and kept until shutdown.
+ *      A new one is opened only while the pool has fewer than
+ *      maxhandles nsdbi handles and aux connections together.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static LiteHandle *
+GetAux(Tcl_Interp *interp, LiteConfig *ltCfg)
+{
+    LiteHandle *ltHandle;
+    LiteFile   *file;
+    Ns_DString  ds;
+    int         i, held = 0, full = 0;
+
+    /*
+     * Without sharedmemory each connection to :memory: is a database
+     * of its own, which no dbi handle could see.
+     */
+
+    if (*ltCfg->datasource == '\0' || strcmp(ltCfg->datasource, ":memory:") == 0) {
+        Ns_TclPrintfResult(interp, "pool \"%s\" has a private in-memory"
+                           " database, set sharedmemory to use it with"
+                           " driver commands", ltCfg->module);
+        return NULL;
+    }
+
+    /*
+     * The write lock isn't reentrant, so a thread within a dbi
+     * transaction would wait for itself.
+     */
+
+    for (i = 0; ltCfg->file != NULL && i <= ltCfg->numShards; i++) {
+        if ((file = SchemaFile(ltCfg, i)) != NULL) {
+            Ns_MutexLock(&file->lock);
+            held |= (file->owner == Ns_ThreadId());
+            Ns_MutexUnlock(&file->lock);
+        }
+    }
+    if (held) {
+        Ns_TclPrintfResult(interp, "pool \"%s\": this thread holds the"
+                           " write lock, driver commands can't be used"
+                           " within a dbi transaction", ltCfg->module);
+        return NULL;
+    }
+
+    Ns_MutexLock(&ltCfg->lock);
+    ltHandle = ltCfg->auxPtr;
+    if (ltHandle != NULL) {
+        ltCfg->auxPtr = ltHandle->nextPtr;
+        ltHandle->nextPtr = NULL;
+    } else if (ltCfg->maxHandles > 0
+               && ltCfg->numOpen + ltCfg->numAux >= ltCfg->maxHandles) {
+        full = 1;
+    } else {
+        ltCfg->numAux++;
+    }
+    Ns_MutexUnlock(&ltCfg->lock);
+
+    if (full) {
+        Ns_TclPrintfResult(interp, "pool \"%s\": all %d handles in use",
+                           ltCfg->module, ltCfg->maxHandles);
+        return NULL;
+    }
+    if (ltHandle == NULL) {
+        Ns_DStringInit(&ds);
+        ltHandle = NewHandle(ltCfg, &ds);
+        if (ltHandle == NULL) {
+            Tcl_DStringResult(interp, &ds);
+            Ns_MutexLock(&ltCfg->lock);
+            ltCfg->numAux--;
+            Ns_MutexUnlock(&ltCfg->lock);
+        }
+        Ns_DStringFree(&ds);
+    }
+    return ltHandle;
+}
+
+static void
+PutAux(LiteHandle *ltHandle)
+{
+    LiteConfig *ltCfg = ltHandle->ltCfg;
+
+    WriteUnlock(ltHandle, ltHandle->writeLock);
+    if (!sqlite3_get_autocommit(ltHandle->conn)) {
+        (void) TxnStep(ltHandle, LITE_TXN_ROLLBACK);
+    }
+    if (ltHandle->timeout > 0) {
+        /* NB: Commands which don't call StartStatement() run untimed. */
+        sqlite3_progress_handler(ltHandle->conn, 0, NULL, NULL);
+        ltHandle->timeout = 0;
+    }
+    SampleMemory(ltHandle);
+
+    Ns_MutexLock(&ltCfg->lock);
+    ltHandle->nextPtr = ltCfg->auxPtr;
+    ltCfg->auxPtr = ltHandle;
+    Ns_MutexUnlock(&ltCfg->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ObjToValues --
+ *
+ *      Convert a list of Tcl values to nsdbi values. Empty strings
+ *      are NULL, as for nsdbi bind variables, and byte arrays are
+ *      binary.
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR if the list is not numVars long.
+ *
+ * Side effects:
+ *      Values point into the list elements.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ObjToValues(Tcl_Interp *interp, Tcl_Obj *listObj,
+            unsigned int numVars, Dbi_Value *values)
+{
+    Tcl_Obj     **elemv;
+    int           elemc, length;
+    unsigned int  i;
+
+    if (Tcl_ListObjGetElements(interp, listObj, &elemc, &elemv) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if ((unsigned int) elemc != numVars) {
+        Ns_TclPrintfResult(interp, "row has %d values, statement has %u variables",
+                           elemc, numVars);
+        return TCL_ERROR;
+    }
+    for (i = 0u; i < numVars; i++) {
+        if (elemv[i]->typePtr == byteArrayTypePtr) {
+            values[i].data = (CONST char *) Tcl_GetByteArrayFromObj(elemv[i], &length);
+            values[i].binary = 1;
+        } else {
+            values[i].data = Tcl_GetStringFromObj(elemv[i], &length);
+            values[i].binary = 0;
+        }
+        values[i].length = (size_t) length;
+        if (length == 0) {
+            values[i].data = NULL;
+        }
+    }
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DmlManyObjCmd --
+ *
+ *      Implements dbilite::dml_many: run one DML statement over many
+ *      rows of values, binding, stepping and resetting the prepared
+ *      statement in a loop.
+ *
+ *      dbilite::dml_many ?-db pool? ?-transaction? sql rows
+ *
+ *      Variables in sql are positional, and each row is a list of as
+ *      many values. With -transaction all rows commit or roll back
+ *      together, otherwise each row commits alone and rows before a
+ *      failing row remain.
+ *
+ * Results:
+ *      Standard Tcl result: a list of rows affected by each row.
+ *
+ * Side effects:
+ *      Takes the pool's write lock, if any, for the duration.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DmlManyObjCmd(ClientData clientData, Tcl_Interp *interp,
+              int objc, Tcl_Obj *CONST objv[])
+{
+    LiteConfig    *ltCfg;
+    LiteHandle    *ltHandle;
+    sqlite3_stmt  *st = NULL;
+    Tcl_Obj       *rowsObj, **rowv, *resultObj;
+    Dbi_Value     *values = NULL;
+    Ns_Time        wait;
+    char          *pool = NULL, *sql;
+    CONST char    *tail = NULL;
+    unsigned int   numVars = 0u;
+    int            txn = 0, rowc, r, rc, status = TCL_ERROR;
+
+    Ns_ObjvSpec opts[] = {
+        {"-db",          Ns_ObjvString, &pool, NULL},
+        {"-transaction", Ns_ObjvBool,   &txn,  INT2PTR(NS_TRUE)},
+        {"--",           Ns_ObjvBreak,  NULL,  NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"sql",  Ns_ObjvString, &sql,     NULL},
+        {"rows", Ns_ObjvObj,    &rowsObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK
+            || Tcl_ListObjGetElements(interp, rowsObj, &rowc, &rowv) != TCL_OK
+            || (ltCfg = GetPool(interp, clientData, pool)) == NULL
+            || (ltHandle = GetAux(interp, ltCfg)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    if (sqlite3_prepare_v2(ltHandle->conn, sql, -1, &st, &tail) != SQLITE_OK) {
+        goto error;
+    }
+    if (st == NULL || sqlite3_column_count(st) > 0) {
+        Tcl_SetResult(interp, "query was not a DML or DDL command", TCL_STATIC);
+        goto done;
+    }
+    if (!EmptyTail(tail, sql + strlen(sql))) {
+        Tcl_SetResult(interp, "query contains more than one statement,"
+                      " use dbilite::script", TCL_STATIC);
+        goto done;
+    }
+    numVars = (unsigned int) sqlite3_bind_parameter_count(st);
+    values = ns_calloc(MAX(numVars, 1u), sizeof(Dbi_Value));
+
+    if (ltCfg->file != NULL
+            && WriteLock(ltHandle, LITE_LOCK_TXN, LITE_SCHEMA_ALL) != NS_OK) {
+        Ns_TclPrintfResult(interp, "write lock still busy after waiting %d msec",
+                           ltCfg->busyTimeout);
+        goto done;
+    }
+    if (txn && TxnStep(ltHandle, LITE_TXN_BEGIN_IMMEDIATE) != SQLITE_OK) {
+        goto error;
+    }
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    Tcl_SetObjResult(interp, resultObj);
+    wait.sec = wait.usec = 0;
+
+    /*
+     * The statement timeout covers all rows.
+     */
+
+    StartStatement(ltHandle);
+    for (r = 0; r < rowc; r++) {
+        if (ObjToValues(interp, rowv[r], numVars, values) != TCL_OK) {
+            Tcl_AppendPrintfToObj(Tcl_GetObjResult(interp), " (row %d)", r);
+            goto done;
+        }
+        rc = BindValues(st, values, numVars, ltCfg->bindMode);
+        if (rc == SQLITE_OK) {
+            rc = StepStmt(ltHandle, st, &wait);
+        }
+        if (rc != SQLITE_DONE) {
+            ltHandle->stats.errors++;
+            (void) sqlite3_reset(st);
+            Ns_TclPrintfResult(interp, "%s (row %d)",
+                               sqlite3_errmsg(ltHandle->conn), r);
+            goto done;
+        }
+        (void) Tcl_ListObjAppendElement(interp, resultObj,
+                                        Tcl_NewIntObj(sqlite3_changes(ltHandle->conn)));
+        (void) sqlite3_reset(st);
+    }
+    ltHandle->running = 0;
+
+    if (txn && TxnStep(ltHandle, LITE_TXN_COMMIT) != SQLITE_OK) {
+        goto error;
+    }
+    status = TCL_OK;
+    goto done;
+
+ error:
+    Tcl_SetResult(interp, (char *) sqlite3_errmsg(ltHandle->conn), TCL_VOLATILE);
+
+ done:
+    ltHandle->running = 0;
+    (void) sqlite3_finalize(st);
+    ns_free(values);
+    PutAux(ltHandle);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RowsObjCmd --
+ *
+ *      Implements dbilite::rows: like dbi_rows, but the values are
+ *      Tcl objects of their sqlite storage class, so numbers need
+ *      not be formatted as text and parsed back.
+ *
+ *      dbilite::rows ?-db pool? ?-columns varName? sql ?values?
+ *
+ *      Variables in sql are positional, bound from the list values.
+ *
+ * Results:
+ *      Standard Tcl result: a flat list of rows.
+ *
+ * Side effects:
+ *      The column names are left in varName if given. Writes take
+ *      the pool's write lock, if any.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+RowsObjCmd(ClientData clientData, Tcl_Interp *interp,
+           int objc, Tcl_Obj *CONST objv[])
+{
+    LiteConfig    *ltCfg;
+    LiteHandle    *ltHandle;
+    sqlite3_stmt  *st = NULL;
+    Tcl_Obj       *valuesObj = NULL, *resultObj, *colsObj;
+    Dbi_Value     *values = NULL;
+    Ns_Time        wait;
+    char          *pool = NULL, *colsVar = NULL, *sql;
+    CONST char    *tail = NULL;
+    unsigned int   numVars;
+    int            numCols, col, rc, status = TCL_ERROR;
+
+    Ns_ObjvSpec opts[] = {
+        {"-db",      Ns_ObjvString, &pool,    NULL},
+        {"-columns", Ns_ObjvString, &colsVar, NULL},
+        {"--",       Ns_ObjvBreak,  NULL,     NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"sql",     Ns_ObjvString, &sql,       NULL},
+        {"?values", Ns_ObjvObj,    &valuesObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK
+            || (ltCfg = GetPool(interp, clientData, pool)) == NULL
+            || (ltHandle = GetAux(interp, ltCfg)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    if (sqlite3_prepare_v2(ltHandle->conn, sql, -1, &st, &tail) != SQLITE_OK) {
+        goto error;
+    }
+    if (st == NULL) {
+        Tcl_SetResult(interp, "empty query", TCL_STATIC);
+        goto done;
+    }
+    if (!EmptyTail(tail, sql + strlen(sql))) {
+        Tcl_SetResult(interp, "query contains more than one statement,"
+                      " use dbilite::script", TCL_STATIC);
+        goto done;
+    }
+    numVars = (unsigned int) sqlite3_bind_parameter_count(st);
+    values = ns_calloc(MAX(numVars, 1u), sizeof(Dbi_Value));
+    if (valuesObj != NULL) {
+        if (ObjToValues(interp, valuesObj, numVars, values) != TCL_OK) {
+            goto done;
+        }
+    } else if (numVars > 0u) {
+        Ns_TclPrintfResult(interp, "statement has %u variables", numVars);
+        goto done;
+    }
+    if (BindValues(st, values, numVars, ltCfg->bindMode) != SQLITE_OK) {
+        goto error;
+    }
+
+    numCols = sqlite3_column_count(st);
+    if (colsVar != NULL) {
+        colsObj = Tcl_NewListObj(0, NULL);
+        for (col = 0; col < numCols; col++) {
+            (void) Tcl_ListObjAppendElement(interp, colsObj,
+                Tcl_NewStringObj(sqlite3_column_name(st, col), -1));
+        }
+        if (Tcl_SetVar2Ex(interp, colsVar, NULL, colsObj,
+                          TCL_LEAVE_ERR_MSG) == NULL) {
+            goto done;
+        }
+    }
+
+    if (ltCfg->file != NULL && !sqlite3_stmt_readonly(st)
+            && WriteLock(ltHandle, LITE_LOCK_STMT, LITE_SCHEMA_ALL) != NS_OK) {
+        Ns_TclPrintfResult(interp, "write lock still busy after waiting %d msec",
+                           ltCfg->busyTimeout);
+        goto done;
+    }
+    resultObj = Tcl_NewListObj(0, NULL);
+    Tcl_SetObjResult(interp, resultObj);
+    wait.sec = wait.usec = 0;
+
+    StartStatement(ltHandle);
+    while ((rc = StepStmt(ltHandle, st, &wait)) == SQLITE_ROW) {
+        for (col = 0; col < numCols; col++) {
+            (void) Tcl_ListObjAppendElement(interp, resultObj, ColumnObj(st, col));
+        }
+    }
+    ltHandle->running = 0;
+    WriteUnlock(ltHandle, LITE_LOCK_STMT);
+
+    if (rc != SQLITE_DONE) {
+        ltHandle->stats.errors++;
+        goto error;
+    }
+    status = TCL_OK;
+    goto done;
+
+ error:
+    Tcl_SetResult(interp, (char *) sqlite3_errmsg(ltHandle->conn), TCL_VOLATILE);
+
+ done:
+    (void) sqlite3_finalize(st);
+    ns_free(values);
+    PutAux(ltHandle);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExportObjCmd --
+ *
+ *      Implements dbilite::export: format the rows of a query as CSV,
+ *      a JSON array of objects or JSON lines while stepping it.
+ *
+ *      dbilite::export ?-db pool? ?-format csv|json|jsonl? ?-header bool?
+ *          ?-channel chan | -conn? ?-chunksize bytes? sql ?values?
+ *
+ *      Output is written to the channel, or streamed to the current
+ *      connection, each time chunksize bytes have been formatted, or
+ *      else returned.
+ *
+ * Results:
+ *      Standard Tcl result: the text, or the number of rows written.
+ *
+ * Side effects:
+ *      With -conn, sets the content type and sends the response
+ *      headers with the first chunk.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ExportObjCmd(ClientData clientData, Tcl_Interp *interp,
+             int objc, Tcl_Obj *CONST objv[])
+{
+    LiteConfig    *ltCfg;
+    LiteHandle    *ltHandle;
+    sqlite3_stmt  *st = NULL;
+    Tcl_Obj       *valuesObj = NULL;
+    Tcl_Channel    chan = NULL;
+    Ns_Conn       *conn = NULL;
+    Dbi_Value     *values = NULL;
+    Ns_DString     ds;
+    Ns_Time        wait;
+    char          *pool = NULL, *chanName = NULL, *sql;
+    CONST char    *tail = NULL;
+    unsigned int   numVars;
+    int            format = LITE_EXPORT_CSV, header = 1, toConn = 0;
+    int            chunkSize = 16384, numCols, col, rows = 0, rc;
+    int            status = TCL_ERROR;
+
+    static CONST char *CONST types[] = {
+        "text/csv; charset=utf-8", "application/json", "application/x-ndjson"
+    };
+    static Ns_ObjvTable formats[] = {
+        {"csv",   LITE_EXPORT_CSV},
+        {"json",  LITE_EXPORT_JSON},
+        {"jsonl", LITE_EXPORT_JSONL},
+        {NULL,    0u}
+    };
+    Ns_ObjvSpec opts[] = {
+        {"-db",        Ns_ObjvString, &pool,      NULL},
+        {"-format",    Ns_ObjvIndex,  &format,    formats},
+        {"-header",    Ns_ObjvBool,   &header,    NULL},
+        {"-channel",   Ns_ObjvString, &chanName,  NULL},
+        {"-conn",      Ns_ObjvBool,   &toConn,    INT2PTR(NS_TRUE)},
+        {"-chunksize", Ns_ObjvInt,    &chunkSize, NULL},
+        {"--",         Ns_ObjvBreak,  NULL,       NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"sql",     Ns_ObjvString, &sql,       NULL},
+        {"?values", Ns_ObjvObj,    &valuesObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+    if (chanName != NULL
+            && (chan = Tcl_GetChannel(interp, chanName, NULL)) == NULL) {
+        return TCL_ERROR;
+    }
+    if (toConn && (conn = Ns_GetConn()) == NULL) {
+        Tcl_SetResult(interp, "no connection", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if ((ltCfg = GetPool(interp, clientData, pool)) == NULL
+            || (ltHandle = GetAux(interp, ltCfg)) == NULL) {
+        return TCL_ERROR;
+    }
+    Ns_DStringInit(&ds);
+
+    if (sqlite3_prepare_v2(ltHandle->conn, sql, -1, &st, &tail) != SQLITE_OK) {
+        goto error;
+    }
+    if (st == NULL || !sqlite3_stmt_readonly(st)
+            || (numCols = sqlite3_column_count(st)) == 0) {
+        Tcl_SetResult(interp, "query was not a statement returning rows", TCL_STATIC);
+        goto done;
+    }
+    if (!EmptyTail(tail, sql + strlen(sql))) {
+        Tcl_SetResult(interp, "query contains more than one statement,"
+                      " use dbilite::script", TCL_STATIC);
+        goto done;
+    }
+    numVars = (unsigned int) sqlite3_bind_parameter_count(st);
+    values = ns_calloc(MAX(numVars, 1u), sizeof(Dbi_Value));
+    if (valuesObj != NULL) {
+        if (ObjToValues(interp, valuesObj, numVars, values) != TCL_OK) {
+            goto done;
+        }
+    } else if (numVars > 0u) {
+        Ns_TclPrintfResult(interp, "statement has %u variables", numVars);
+        goto done;
+    }
+    if (BindValues(st, values, numVars, ltCfg->bindMode) != SQLITE_OK) {
+        goto error;
+    }
+
+    if (conn != NULL) {
+        Ns_ConnSetTypeHeader(conn, types[format]);
+    }
+    if (format == LITE_EXPORT_JSON) {
+        Ns_DStringNAppend(&ds, "[", 1);
+    } else if (format == LITE_EXPORT_CSV && header) {
+        for (col = 0; col < numCols; col++) {
+            if (col > 0) {
+                Ns_DStringNAppend(&ds, ",", 1);
+            }
+            ExportString(&ds, sqlite3_column_name(st, col), -1, format);
+        }
+        Ns_DStringNAppend(&ds, "\r\n", 2);
+    }
+
+    wait.sec = wait.usec = 0;
+    StartStatement(ltHandle);
+    while ((rc = StepStmt(ltHandle, st, &wait)) == SQLITE_ROW) {
+        if (format == LITE_EXPORT_CSV) {
+            for (col = 0; col < numCols; col++) {
+                if (col > 0) {
+                    Ns_DStringNAppend(&ds, ",", 1);
+                }
+                ExportCell(&ds, st, col, format);
+            }
+            Ns_DStringNAppend(&ds, "\r\n", 2);
+        } else {
+            if (format == LITE_EXPORT_JSON && rows > 0) {
+                Ns_DStringNAppend(&ds, ",", 1);
+            }
+            Ns_DStringNAppend(&ds, "{", 1);
+            for (col = 0; col < numCols; col++) {
+                if (col > 0) {
+                    Ns_DStringNAppend(&ds, ",", 1);
+                }
+                ExportString(&ds, sqlite3_column_name(st, col), -1, format);
+                Ns_DStringNAppend(&ds, ":", 1);
+                ExportCell(&ds, st, col, format);
+            }
+            Ns_DStringNAppend(&ds, format == LITE_EXPORT_JSONL ? "}\n" : "}", -1);
+        }
+        rows++;
+        if ((conn != NULL || chan != NULL) && Ns_DStringLength(&ds) >= chunkSize
+                && ExportFlush(interp, conn, chan, &ds) != TCL_OK) {
+            break;
+        }
+    }
+    ltHandle->running = 0;
+
+    if (rc == SQLITE_ROW) {
+        (void) sqlite3_reset(st);
+        goto done;
+    }
+    if (rc != SQLITE_DONE) {
+        ltHandle->stats.errors++;
+        goto error;
+    }
+    if (format == LITE_EXPORT_JSON) {
+        Ns_DStringNAppend(&ds, "]", 1);
+    }
+    if (conn == NULL && chan == NULL) {
+        Tcl_DStringResult(interp, &ds);
+    } else if (ExportFlush(interp, conn, chan, &ds) == TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(rows));
+    } else {
+        goto done;
+    }
+    status = TCL_OK;
+    goto done;
+
+ error:
+    Tcl_SetResult(interp, (char *) sqlite3_errmsg(ltHandle->conn), TCL_VOLATILE);
+
+ done:
+    (void) sqlite3_finalize(st);
+    ns_free(values);
+    Ns_DStringFree(&ds);
+    PutAux(ltHandle);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExportCell, ExportString, AppendBase64 --
+ *
+ *      Append a cell of the current row, or a string, in the given
+ *      export format. Numbers are written bare, blobs as base64 and
+ *      nulls as an empty CSV field or JSON null.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ExportCell(Ns_DString *dsPtr, sqlite3_stmt *st, int col, int format)
+{
+    CONST char *text;
+    char        buf[24];
+    int         json = (format != LITE_EXPORT_CSV);
+
+    switch (sqlite3_column_type(st, col)) {
+    case SQLITE_NULL:
+        if (json) {
+            Ns_DStringNAppend(dsPtr, "null", 4);
+        }
+        break;
+    case SQLITE_INTEGER:
+        Ns_DStringNAppend(dsPtr, buf,
+                          (int) FormatInt(buf, sqlite3_column_int64(st, col)));
+        break;
+    case SQLITE_FLOAT:
+        text = (CONST char *) sqlite3_column_text(st, col);
+        if (json && strchr(text, 'I') != NULL) {
+            text = "null";  /* Inf is not a JSON number. */
+        }
+        Ns_DStringAppend(dsPtr, text);
+        break;
+    case SQLITE_BLOB:
+        if (json) {
+            Ns_DStringNAppend(dsPtr, "\"", 1);
+        }
+        AppendBase64(dsPtr, sqlite3_column_blob(st, col),
+                     sqlite3_column_bytes(st, col));
+        if (json) {
+            Ns_DStringNAppend(dsPtr, "\"", 1);
+        }
+        break;
+    default:
+        ExportString(dsPtr, (CONST char *) sqlite3_column_text(st, col),
+                     sqlite3_column_bytes(st, col), format);
+        break;
+    }
+}
+
+static void
+ExportString(Ns_DString *dsPtr, CONST char *string, int length, int format)
+{
+    CONST char *p, *end, *start;
+    char        buf[8];
+
+    if (length < 0) {
+        length = (int) strlen(string);
+    }
+    end = string + length;
+
+    if (format == LITE_EXPORT_CSV) {
+        for (p = string; p < end; p++) {
+            if (*p == ',' || *p == '"' || *p == '\r' || *p == '\n') {
+                break;
+            }
+        }
+        if (p == end) {
+            Ns_DStringNAppend(dsPtr, string, length);
+            return;
+        }
+        Ns_DStringNAppend(dsPtr, "\"", 1);
+        for (start = p = string; p < end; p++) {
+            if (*p == '"') {
+                Ns_DStringNAppend(dsPtr, start, (int) (p - start + 1));
+                start = p;
+            }
+        }
+        Ns_DStringNAppend(dsPtr, start, (int) (end - start));
+        Ns_DStringNAppend(dsPtr, "\"", 1);
+        return;
+    }
+
+    Ns_DStringNAppend(dsPtr, "\"", 1);
+    for (start = p = string; p < end; p++) {
+        if (*p != '"' && *p != '\\' && UCHAR(*p) >= 0x20u) {
+            continue;
+        }
+        Ns_DStringNAppend(dsPtr, start, (int) (p - start));
+        switch (*p) {
+        case '"':
+            Ns_DStringNAppend(dsPtr, "\\\"", 2);
+            break;
+        case '\\':
+            Ns_DStringNAppend(dsPtr, "\\\\", 2);
+            break;
+        case '\n':
+            Ns_DStringNAppend(dsPtr, "\\n", 2);
+            break;
+        case '\r':
+            Ns_DStringNAppend(dsPtr, "\\r", 2);
+            break;
+        case '\t':
+            Ns_DStringNAppend(dsPtr, "\\t", 2);
+            break;
+        default:
+            snprintf(buf, sizeof(buf), "\\u%04x", UCHAR(*p));
+            Ns_DStringNAppend(dsPtr, buf, 6);
+            break;
+        }
+        start = p + 1;
+    }
+    Ns_DStringNAppend(dsPtr, start, (int) (end - start));
+    Ns_DStringNAppend(dsPtr, "\"", 1);
+}
+
+static void
+AppendBase64(Ns_DString *dsPtr, CONST unsigned char *data, int length)
+{
+    static CONST char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char         *p;
+    unsigned int  n;
+    int           i, offset = Ns_DStringLength(dsPtr);
+
+    Ns_DStringSetLength(dsPtr, offset + (length + 2) / 3 * 4);
+    p = Ns_DStringValue(dsPtr) + offset;
+    for (i = 0; i + 2 < length; i += 3) {
+        n = (unsigned int) data[i] << 16 | (unsigned int) data[i + 1] << 8 | data[i + 2];
+        *p++ = digits[n >> 18];
+        *p++ = digits[(n >> 12) & 63u];
+        *p++ = digits[(n >> 6) & 63u];
+        *p++ = digits[n & 63u];
+    }
+    if (i < length) {
+        n = (unsigned int) data[i] << 16;
+        if (i + 1 < length) {
+            n |= (unsigned int) data[i + 1] << 8;
+        }
+        *p++ = digits[n >> 18];
+        *p++ = digits[(n >> 12) & 63u];
+        *p++ = i + 1 < length ? digits[(n >> 6) & 63u] : '=';
+        *p++ = '=';
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExportFlush --
+ *
+ *      Write the formatted rows to the channel or connection.
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR if the write failed.
+ *
+ * Side effects:
+ *      The dstring is emptied.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ExportFlush(Tcl_Interp *interp, Ns_Conn *conn, Tcl_Channel chan,
+            Ns_DString *dsPtr)
+{
+    int status = TCL_OK;
+
+    if (Ns_DStringLength(dsPtr) == 0) {
+        return TCL_OK;
+    }
+    if (conn != NULL) {
+        if (Ns_ConnWriteData(conn, Ns_DStringValue(dsPtr),
+                             (size_t) Ns_DStringLength(dsPtr), NS_CONN_STREAM)
+                != NS_OK) {
+            Tcl_SetResult(interp, "connection write failed", TCL_STATIC);
+            status = TCL_ERROR;
+        }
+    } else if (Tcl_WriteChars(chan, Ns_DStringValue(dsPtr),
+                              Ns_DStringLength(dsPtr)) < 0) {
+        Ns_TclPrintfResult(interp, "channel write failed: %s",
+                           Tcl_PosixError(interp));
+        status = TCL_ERROR;
+    }
+    Ns_DStringSetLength(dsPtr, 0);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ScriptObjCmd --
+ *
+ *      Implements dbilite::script. Runs each statement of a script in
+ *      turn, discarding any rows, optionally in one transaction.
+ *
+ * Results:
+ *      Standard Tcl result: the total number of rows changed. Errors
+ *      give the offset of the failing statement in the script.
+ *
+ * Side effects:
+ *      Holds the write lock, if any, until done.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ScriptObjCmd(ClientData clientData, Tcl_Interp *interp,
+             int objc, Tcl_Obj *CONST objv[])
+{
+    LiteConfig    *ltCfg;
+    LiteHandle    *ltHandle;
+    sqlite3_stmt  *st = NULL;
+    Ns_Time        wait;
+    char          *pool = NULL, *script;
+    CONST char    *sql, *tail;
+    int            txn = 0, changes, rc, status = TCL_ERROR;
+
+    Ns_ObjvSpec opts[] = {
+        {"-db",          Ns_ObjvString, &pool, NULL},
+        {"-transaction", Ns_ObjvBool,   &txn,  INT2PTR(NS_TRUE)},
+        {"--",           Ns_ObjvBreak,  NULL,  NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"sql", Ns_ObjvString, &script, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK
+            || (ltCfg = GetPool(interp, clientData, pool)) == NULL
+            || (ltHandle = GetAux(interp, ltCfg)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    if (ltCfg->file != NULL
+            && WriteLock(ltHandle, LITE_LOCK_TXN, LITE_SCHEMA_ALL) != NS_OK) {
+        Ns_TclPrintfResult(interp, "write lock still busy after waiting %d msec",
+                           ltCfg->busyTimeout);
+        goto done;
+    }
+    if (txn && TxnStep(ltHandle, LITE_TXN_BEGIN_IMMEDIATE) != SQLITE_OK) {
+        Tcl_SetResult(interp, (char *) sqlite3_errmsg(ltHandle->conn), TCL_VOLATILE);
+        goto done;
+    }
+
+    changes = sqlite3_total_changes(ltHandle->conn);
+    wait.sec = wait.usec = 0;
+
+    for (sql = script; *sql != '\0'; sql = tail) {
+        while (isspace(UCHAR(*sql))) {
+            sql++;
+        }
+        if (sqlite3_prepare_v2(ltHandle->conn, sql, -1, &st, &tail) != SQLITE_OK) {
+            goto error;
+        }
+        if (st == NULL) {
+            continue;
+        }
+        ltHandle->stats.prepares++;
+        while ((rc = StepStmt(ltHandle, st, &wait)) == SQLITE_ROW) {
+            ;
+        }
+        if (rc != SQLITE_DONE) {
+            goto error;
+        }
+        (void) sqlite3_finalize(st);
+        ltHandle->stats.finalizes++;
+        st = NULL;
+    }
+
+    if (txn && TxnStep(ltHandle, LITE_TXN_COMMIT) != SQLITE_OK) {
+        Tcl_SetResult(interp, (char *) sqlite3_errmsg(ltHandle->conn), TCL_VOLATILE);
+        goto done;
+    }
+    Tcl_SetObjResult(interp,
+                     Tcl_NewIntObj(sqlite3_total_changes(ltHandle->conn) - changes));
+    status = TCL_OK;
+    goto done;
+
+ error:
+    ltHandle->stats.errors++;
+    Ns_TclPrintfResult(interp, "%s (offset %ld)",
+                       sqlite3_errmsg(ltHandle->conn), (long) (sql - script));
+
+ done:
+    (void) sqlite3_finalize(st);
+    PutAux(ltHandle);
+
+    return status;
+}
+
+
+#ifdef SQLITE_ENABLE_SNAPSHOT
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SnapshotObjCmd --
+ *
+ *      Implements dbilite::snapshot. Records the current state of a
+ *      WAL database for transactions of dbilite::with_snapshot.
+ *
+ * Results:
+ *      Standard Tcl result: a snapshot token.
+ *
+ * Side effects:
+ *      The snapshot stays until dbilite::snapshot_free.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SnapshotObjCmd(ClientData clientData, Tcl_Interp *interp,
+               int objc, Tcl_Obj *CONST objv[])
+{
+    static unsigned long  nextId = 0u;
+    LiteConfig           *ltCfg;
+    LiteHandle           *ltHandle;
+    LiteSnapshot         *snapPtr;
+    sqlite3_snapshot     *snapshot = NULL;
+    Tcl_HashEntry        *hPtr;
+    char                 *pool = NULL, token[64];
+    int                   version, isNew, rc;
+
+    Ns_ObjvSpec opts[] = {
+        {"-db", Ns_ObjvString, &pool, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, NULL, interp, 1, objc, objv) != NS_OK
+            || (ltCfg = GetPool(interp, clientData, pool)) == NULL
+            || (ltHandle = GetAux(interp, ltCfg)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    /*
+     * A snapshot is of the read transaction open on the connection.
+     */
+
+    rc = TxnStep(ltHandle, LITE_TXN_BEGIN);
+    if (rc == SQLITE_OK) {
+        rc = PragmaInt(ltHandle, "PRAGMA schema_version", &version);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_snapshot_get(ltHandle->conn, "main", &snapshot);
+    }
+    if (rc != SQLITE_OK) {
+        Ns_TclPrintfResult(interp, "could not make snapshot: %s%s",
+                           sqlite3_errstr(rc),
+                           rc == SQLITE_ERROR ? " (journal_mode is not wal?)" : "");
+    }
+    if (!sqlite3_get_autocommit(ltHandle->conn)) {
+        (void) TxnStep(ltHandle, LITE_TXN_COMMIT);
+    }
+    PutAux(ltHandle);
+    if (rc != SQLITE_OK) {
+        return TCL_ERROR;
+    }
+
+    snapPtr = ns_calloc(1, sizeof(LiteSnapshot));
+    snapPtr->snapshot = snapshot;
+    Ns_MutexLock(&snapshotsLock);
+    snprintf(token, sizeof(token), "dbilite:snapshot:%lu", nextId++);
+    hPtr = Tcl_CreateHashEntry(&snapshots, token, &isNew);
+    Tcl_SetHashValue(hPtr, snapPtr);
+    Ns_MutexUnlock(&snapshotsLock);
+
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(token, -1));
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SnapshotFreeObjCmd, ReleaseSnapshot --
+ *
+ *      Implements dbilite::snapshot_free. The snapshot is freed once
+ *      the last dbilite::with_snapshot using it returns.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      The token becomes invalid.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SnapshotFreeObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp,
+                   int objc, Tcl_Obj *CONST objv[])
+{
+    LiteSnapshot  *snapPtr = NULL;
+    Tcl_HashEntry *hPtr;
+    char          *token;
+
+    Ns_ObjvSpec args[] = {
+        {"token", Ns_ObjvString, &token, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(NULL, args, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+
+    Ns_MutexLock(&snapshotsLock);
+    hPtr = Tcl_FindHashEntry(&snapshots, token);
+    if (hPtr != NULL) {
+        snapPtr = Tcl_GetHashValue(hPtr);
+        Tcl_DeleteHashEntry(hPtr);
+        snapPtr->released = 1;
+        ReleaseSnapshot(snapPtr);
+    }
+    Ns_MutexUnlock(&snapshotsLock);
+
+    if (snapPtr == NULL) {
+        Ns_TclPrintfResult(interp, "no such snapshot: %s", token);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static void
+ReleaseSnapshot(LiteSnapshot *snapPtr)
+{
+    if (snapPtr->released && snapPtr->refCount == 0) {
+        sqlite3_snapshot_free(snapPtr->snapshot);
+        ns_free(snapPtr);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WithSnapshotObjCmd --
+ *
+ *      Implements dbilite::with_snapshot. Evaluates a script in which
+ *      transactions of any pool on the same database read at the
+ *      snapshot, so that threads running queries in parallel see the
+ *      same data.
+ *
+ * Results:
+ *      Result of the script.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WithSnapshotObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp,
+                   int objc, Tcl_Obj *CONST objv[])
+{
+    LiteSnapshot  *snapPtr = NULL;
+    Tcl_HashEntry *hPtr;
+    Tcl_Obj       *scriptObj;
+    char          *token;
+    void          *saved;
+    int            status;
+
+    Ns_ObjvSpec args[] = {
+        {"token",  Ns_ObjvString, &token,     NULL},
+        {"script", Ns_ObjvObj,    &scriptObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(NULL, args, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+
+    Ns_MutexLock(&snapshotsLock);
+    hPtr = Tcl_FindHashEntry(&snapshots, token);
+    if (hPtr != NULL) {
+        snapPtr = Tcl_GetHashValue(hPtr);
+        snapPtr->refCount++;
+    }
+    Ns_MutexUnlock(&snapshotsLock);
+
+    if (snapPtr == NULL) {
+        Ns_TclPrintfResult(interp, "no such snapshot: %s", token);
+        return TCL_ERROR;
+    }
+
+    saved = Ns_TlsGet(&snapshotTls);
+    Ns_TlsSet(&snapshotTls, snapPtr);
+    status = Tcl_EvalObjEx(interp, scriptObj, 0);
+    Ns_TlsSet(&snapshotTls, saved);
+
+    Ns_MutexLock(&snapshotsLock);
+    snapPtr->refCount--;
+    ReleaseSnapshot(snapPtr);
+    Ns_MutexUnlock(&snapshotsLock);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * OpenSnapshot --
+ *
+ *      Start the read transaction begun on the handle at a snapshot.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      On error the transaction is rolled back and fails with
+ *      exception code SQSNP, e.g. once a checkpoint has restarted
+ *      the WAL past the snapshot.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+OpenSnapshot(LiteHandle *ltHandle, LiteSnapshot *snapPtr)
+{
+    int rc;
+
+    rc = sqlite3_snapshot_open(ltHandle->conn, "main", snapPtr->snapshot);
+    if (rc != SQLITE_OK) {
+        (void) TxnStep(ltHandle, LITE_TXN_ROLLBACK);
+        Dbi_SetException(ltHandle->handle, "SQSNP",
+                         "dbilite: could not open snapshot: %s",
+                         rc == SQLITE_ERROR_SNAPSHOT
+                         ? "no longer available" : sqlite3_errstr(rc));
+        return NS_ERROR;
+    }
+    return NS_OK;
+}
+
+#endif /* SQLITE_ENABLE_SNAPSHOT */
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WithTimeoutObjCmd --
+ *
+ *      Implements dbilite::with_timeout. Evaluates a script with the
+ *      statement timeout of all pools set to msec, 0 for none.
+ *
+ * Results:
+ *      Result of the script.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WithTimeoutObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp,
+                  int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *scriptObj;
+    void    *saved;
+    int      timeout, status;
+
+    Ns_ObjvSpec args[] = {
+        {"msec",   Ns_ObjvInt, &timeout,   NULL},
+        {"script", Ns_ObjvObj, &scriptObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(NULL, args, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+    if (timeout < 0) {
+        Tcl_SetResult(interp, "msec must be positive", TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    saved = Ns_TlsGet(&timeoutTls);
+    Ns_TlsSet(&timeoutTls, INT2PTR(timeout + 1));
+    status = Tcl_EvalObjEx(interp, scriptObj, 0);
+    Ns_TlsSet(&timeoutTls, saved);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InterruptObjCmd --
+ *
+ *      Implements dbilite::interrupt. Interrupts statements of the
+ *      pool which have been executing for at least msec.
+ *
+ * Results:
+ *      Standard Tcl result: the number of statements interrupted.
+ *
+ * Side effects:
+ *      The statements fail with exception code SQINT.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+InterruptObjCmd(ClientData clientData, Tcl_Interp *interp,
+                int objc, Tcl_Obj *CONST objv[])
+{
+    LiteConfig *ltCfg;
+    LiteHandle *ltHandle;
+    Ns_Time     now, diff;
+    char       *pool = NULL;
+    int         runningFor = 0, n = 0;
+
+    Ns_ObjvSpec opts[] = {
+        {"-db",         Ns_ObjvString, &pool,       NULL},
+        {"-runningfor", Ns_ObjvInt,    &runningFor, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, NULL, interp, 1, objc, objv) != NS_OK
+            || (ltCfg = GetPool(interp, clientData, pool)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    Ns_GetTime(&now);
+    Ns_MutexLock(&ltCfg->lock);
+    for (ltHandle = ltCfg->livePtr; ltHandle != NULL;
+         ltHandle = ltHandle->nextLivePtr) {
+        if (ltHandle->running) {
+            (void) Ns_DiffTime(&now, &ltHandle->stmtStart, &diff);
+            if (diff.sec * 1000 + diff.usec / 1000 >= runningFor) {
+                sqlite3_interrupt(ltHandle->conn);
+                n++;
+            }
+        }
+    }
+    Ns_MutexUnlock(&ltCfg->lock);
+
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(n));
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ShardObjCmd --
+ *
+ *      Implements dbilite::shard. Map a key to one of the shards of
+ *      the pool by its FNV-1a hash.
+ *
+ * Results:
+ *      Standard Tcl result: the schema name of the shard.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ShardObjCmd(ClientData clientData, Tcl_Interp *interp,
+            int objc, Tcl_Obj *CONST objv[])
+{
+    LiteConfig          *ltCfg;
+    char                *pool = NULL, *key;
+    const unsigned char *p;
+    unsigned int         hash = 2166136261u;
+    int                  length;
+
+    Ns_ObjvSpec opts[] = {
+        {"-db", Ns_ObjvString, &pool, NULL},
+        {"--",  Ns_ObjvBreak,  NULL,  NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"key", Ns_ObjvString, &key, &length},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK
+            || (ltCfg = GetPool(interp, clientData, pool)) == NULL) {
+        return TCL_ERROR;
+    }
+    if (ltCfg->numShards == 0) {
+        Ns_TclPrintfResult(interp, "pool has no shards: %s", ltCfg->module);
+        return TCL_ERROR;
+    }
+
+    for (p = (const unsigned char *) key; length > 0; p++, length--) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(
+        ltCfg->shardNames[hash % (unsigned int) ltCfg->numShards], -1));
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StatsObjCmd --
+ *
+ *      Implements dbilite::stats: report the counters of one or all
+ *      pools, or of each open handle of a pool.
+ *
+ *      dbilite::stats ?-db pool? ?-handles? ?-format dict|prometheus?
+ *
+ * Results:
+ *      Standard Tcl result: a dict of counters for the pool, a list
+ *      of such dicts for -handles, a dict of pool dicts if no pool
+ *      is given, or Prometheus text exposition format.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+StatsObjCmd(ClientData clientData, Tcl_Interp *interp,
+            int objc, Tcl_Obj *CONST objv[])
+{
+    LiteConfig     *ltCfg = NULL, **ltCfgs;
+    LiteHandle     *ltHandle;
+    LiteStats      *stats;
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    Tcl_Obj        *resultObj;
+    Ns_DString      ds;
+    char           *pool = NULL;
+    int            *numHandles, handles = 0, format = 0, numPools = 0, i, j;
+
+    static Ns_ObjvTable formats[] = {
+        {"dict",       0u},
+        {"prometheus", 1u},
+        {NULL,         0u}
+    };
+    Ns_ObjvSpec opts[] = {
+        {"-db",      Ns_ObjvString, &pool,    NULL},
+        {"-handles", Ns_ObjvBool,   &handles, INT2PTR(NS_TRUE)},
+        {"-format",  Ns_ObjvIndex,  &format,  formats},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, NULL, interp, 1, objc, objv) != NS_OK
+            || ((pool != NULL || handles)
+                && (ltCfg = GetPool(interp, clientData, pool)) == NULL)) {
+        return TCL_ERROR;
+    }
+
+    if (handles) {
+        if (format != 0) {
+            Tcl_SetResult(interp, "-handles requires -format dict", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        resultObj = Tcl_NewListObj(0, NULL);
+        Ns_MutexLock(&ltCfg->lock);
+        for (ltHandle = ltCfg->livePtr; ltHandle != NULL;
+             ltHandle = ltHandle->nextLivePtr) {
+            (void) Tcl_ListObjAppendElement(interp, resultObj,
+                                            StatsObj(&ltHandle->stats, -1));
+        }
+        Ns_MutexUnlock(&ltCfg->lock);
+        Tcl_SetObjResult(interp, resultObj);
+        return TCL_OK;
+    }
+
+    /*
+     * Sum the counters of the requested pool, or of all pools
+     * visible to this server.
+     */
+
+    Ns_MutexLock(&poolsLock);
+    ltCfgs = ns_malloc(MAX(pools.numEntries, 1) * sizeof(LiteConfig *));
+    if (ltCfg != NULL) {
+        ltCfgs[numPools++] = ltCfg;
+    } else {
+        hPtr = Tcl_FirstHashEntry(&pools, &search);
+        while (hPtr != NULL) {
+            ltCfg = Tcl_GetHashValue(hPtr);
+            if (ltCfg->server == NULL || strcmp(ltCfg->server, clientData) == 0) {
+                ltCfgs[numPools++] = ltCfg;
+            }
+            hPtr = Tcl_NextHashEntry(&search);
+        }
+        ltCfg = NULL;
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    stats = ns_malloc(MAX(numPools, 1) * sizeof(LiteStats));
+    numHandles = ns_malloc(MAX(numPools, 1) * sizeof(int));
+    for (i = 0; i < numPools; i++) {
+        SumStats(ltCfgs[i], &stats[i], &numHandles[i]);
+    }
+
+    if (format == 1) {
+        Ns_DStringInit(&ds);
+        for (j = 0; counters[j].name != NULL; j++) {
+            Ns_DStringPrintf(&ds, "# HELP dbilite_%s_total %s.\n"
+                             "# TYPE dbilite_%s_total counter\n",
+                             counters[j].name, counters[j].help, counters[j].name);
+            for (i = 0; i < numPools; i++) {
+                Ns_DStringPrintf(&ds, "dbilite_%s_total{pool=\"%s\"} %"
+                                 TCL_LL_MODIFIER "d\n", counters[j].name,
+                                 ltCfgs[i]->module, COUNTER(&stats[i], j));
+            }
+        }
+        for (j = 0; times[j].name != NULL; j++) {
+            Ns_DStringPrintf(&ds, "# HELP dbilite_%s_seconds_total %s.\n"
+                             "# TYPE dbilite_%s_seconds_total counter\n",
+                             times[j].metric, times[j].help, times[j].metric);
+            for (i = 0; i < numPools; i++) {
+                Ns_DStringPrintf(&ds, "dbilite_%s_seconds_total{pool=\"%s\"}"
+                                 " %ld.%06ld\n", times[j].metric,
+                                 ltCfgs[i]->module, TIME(&stats[i], j)->sec,
+                                 TIME(&stats[i], j)->usec);
+            }
+        }
+        Ns_DStringAppend(&ds, "# HELP dbilite_wal_pages WAL size at the last"
+                         " checkpoint.\n"
+                         "# TYPE dbilite_wal_pages gauge\n");
+        for (i = 0; i < numPools; i++) {
+            Ns_DStringPrintf(&ds, "dbilite_wal_pages{pool=\"%s\"} %d\n",
+                             ltCfgs[i]->module, stats[i].walPages);
+        }
+        for (j = 0; j < LITE_MEM_NUM; j++) {
+            Ns_DStringPrintf(&ds, "# HELP dbilite_%s %s.\n"
+                             "# TYPE dbilite_%s gauge\n",
+                             memory[j].metric, memory[j].help, memory[j].metric);
+            for (i = 0; i < numPools; i++) {
+                Ns_DStringPrintf(&ds, "dbilite_%s{pool=\"%s\"} %"
+                                 TCL_LL_MODIFIER "d\n", memory[j].metric,
+                                 ltCfgs[i]->module, stats[i].memory[j]);
+            }
+        }
+        Ns_DStringPrintf(&ds, "# HELP dbilite_sqlite_memory_bytes Memory used"
+                         " by sqlite in the process.\n"
+                         "# TYPE dbilite_sqlite_memory_bytes gauge\n"
+                         "dbilite_sqlite_memory_bytes %" TCL_LL_MODIFIER "d\n",
+                         (Tcl_WideInt) sqlite3_memory_used());
+        Ns_DStringAppend(&ds, "# HELP dbilite_handles Open connections.\n"
+                         "# TYPE dbilite_handles gauge\n");
+        for (i = 0; i < numPools; i++) {
+            Ns_DStringPrintf(&ds, "dbilite_handles{pool=\"%s\"} %d\n",
+                             ltCfgs[i]->module, numHandles[i]);
+        }
+        Tcl_DStringResult(interp, &ds);
+    } else if (ltCfg != NULL) {
+        Tcl_SetObjResult(interp, StatsObj(&stats[0], numHandles[0]));
+    } else {
+        resultObj = Tcl_NewDictObj();
+        for (i = 0; i < numPools; i++) {
+            (void) Tcl_DictObjPut(interp, resultObj,
+                                  Tcl_NewStringObj(ltCfgs[i]->module, -1),
+                                  StatsObj(&stats[i], numHandles[i]));
+        }
+        Tcl_SetObjResult(interp, resultObj);
+    }
+
+    ns_free(numHandles);
+    ns_free(stats);
+    ns_free(ltCfgs);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BlobReadObjCmd --
+ *
+ *      Implements dbilite::blob_read. Copies a blob, or length bytes
+ *      of it from offset, to a channel chunksize bytes at a time.
+ *
+ * Results:
+ *      Standard Tcl result: the number of bytes copied.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BlobReadObjCmd(ClientData clientData, Tcl_Interp *interp,
+               int objc, Tcl_Obj *CONST objv[])
+{
+    LiteConfig    *ltCfg;
+    LiteHandle    *ltHandle;
+    sqlite3_blob  *blob = NULL;
+    Tcl_Channel    chan;
+    Tcl_WideInt    rowid;
+    char          *pool = NULL, *schema = "main", *table, *column, *chanName;
+    char          *buf = NULL;
+    int            offset = 0, length = -1, chunk = 65536, size, n, done = 0;
+    int            status = TCL_ERROR;
+
+    Ns_ObjvSpec opts[] = {
+        {"-db",        Ns_ObjvString, &pool,   NULL},
+        {"-schema",    Ns_ObjvString, &schema, NULL},
+        {"-offset",    Ns_ObjvInt,    &offset, NULL},
+        {"-length",    Ns_ObjvInt,    &length, NULL},
+        {"-chunksize", Ns_ObjvInt,    &chunk,  NULL},
+        {"--",         Ns_ObjvBreak,  NULL,    NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"table",   Ns_ObjvString,  &table,    NULL},
+        {"column",  Ns_ObjvString,  &column,   NULL},
+        {"rowid",   Ns_ObjvWideInt, &rowid,    NULL},
+        {"channel", Ns_ObjvString,  &chanName, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK
+            || (chan = Tcl_GetChannel(interp, chanName, NULL)) == NULL
+            || (ltCfg = GetPool(interp, clientData, pool)) == NULL) {
+        return TCL_ERROR;
+    }
+    if (offset < 0 || chunk <= 0) {
+        Tcl_SetResult(interp, "offset and chunksize must be positive", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if ((ltHandle = GetAux(interp, ltCfg)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    if (sqlite3_blob_open(ltHandle->conn, schema, table, column,
+                          rowid, 0, &blob) != SQLITE_OK) {
+        goto error;
+    }
+    size = sqlite3_blob_bytes(blob) - MIN(offset, sqlite3_blob_bytes(blob));
+    if (length >= 0 && length < size) {
+        size = length;
+    }
+    buf = ns_malloc((size_t) MIN(chunk, MAX(size, 1)));
+
+    while (done < size) {
+        n = MIN(chunk, size - done);
+        if (sqlite3_blob_read(blob, buf, n, offset + done) != SQLITE_OK) {
+            goto error;
+        }
+        if (Tcl_Write(chan, buf, n) != n) {
+            Ns_TclPrintfResult(interp, "error writing \"%s\": %s",
+                               chanName, Tcl_PosixError(interp));
+            goto done;
+        }
+        done += n;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(done));
+    status = TCL_OK;
+    goto done;
+
+ error:
+    ltHandle->stats.errors++;
+    Tcl_SetResult(interp, (char *) sqlite3_errmsg(ltHandle->conn), TCL_VOLATILE);
+
+ done:
+    (void) sqlite3_blob_close(blob);
+    ns_free(buf);
+    PutAux(ltHandle);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BlobWriteObjCmd --
+ *
+ *      Implements dbilite::blob_write. Copies a channel to a blob
+ *      from offset, chunksize bytes at a time, in one transaction.
+ *      The blob must already be large enough, e.g. a zeroblob().
+ *
+ * Results:
+ *      Standard Tcl result: the number of bytes copied.
+ *
+ * Side effects:
+ *      Holds the write lock, if any, until done.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BlobWriteObjCmd(ClientData clientData, Tcl_Interp *interp,
+                int objc, Tcl_Obj *CONST objv[])
+{
+    LiteConfig    *ltCfg;
+    LiteHandle    *ltHandle;
+    sqlite3_blob  *blob = NULL;
+    Tcl_Channel    chan;
+    Tcl_WideInt    rowid;
+    char          *pool = NULL, *schema = "main", *table, *column, *chanName;
+    char          *buf = NULL;
+    int            offset = 0, chunk = 65536, n, done = 0, status = TCL_ERROR;
+
+    Ns_ObjvSpec opts[] = {
+        {"-db",        Ns_ObjvString, &pool,   NULL},
+        {"-schema",    Ns_ObjvString, &schema, NULL},
+        {"-offset",    Ns_ObjvInt,    &offset, NULL},
+        {"-chunksize", Ns_ObjvInt,    &chunk,  NULL},
+        {"--",         Ns_ObjvBreak,  NULL,    NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"table",   Ns_ObjvString,  &table,    NULL},
+        {"column",  Ns_ObjvString,  &column,   NULL},
+        {"rowid",   Ns_ObjvWideInt, &rowid,    NULL},
+        {"channel", Ns_ObjvString,  &chanName, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK
+            || (chan = Tcl_GetChannel(interp, chanName, NULL)) == NULL
+            || (ltCfg = GetPool(interp, clientData, pool)) == NULL) {
+        return TCL_ERROR;
+    }
+    if (offset < 0 || chunk <= 0) {
+        Tcl_SetResult(interp, "offset and chunksize must be positive", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if ((ltHandle = GetAux(interp, ltCfg)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    if (ltCfg->file != NULL
+            && WriteLock(ltHandle, LITE_LOCK_TXN, LITE_SCHEMA_ALL) != NS_OK) {
+        Ns_TclPrintfResult(interp, "write lock still busy after waiting %d msec",
+                           ltCfg->busyTimeout);
+        goto done;
+    }
+    if (TxnStep(ltHandle, LITE_TXN_BEGIN_IMMEDIATE) != SQLITE_OK
+            || sqlite3_blob_open(ltHandle->conn, schema, table, column,
+                                 rowid, 1, &blob) != SQLITE_OK) {
+        goto error;
+    }
+    buf = ns_malloc((size_t) chunk);
+
+    while ((n = Tcl_Read(chan, buf, chunk)) > 0) {
+        if (offset + done + n > sqlite3_blob_bytes(blob)) {
+            Ns_TclPrintfResult(interp, "blob is only %d bytes",
+                               sqlite3_blob_bytes(blob));
+            goto done;
+        }
+        if (sqlite3_blob_write(blob, buf, n, offset + done) != SQLITE_OK) {
+            goto error;
+        }
+        done += n;
+    }
+    if (n < 0) {
+        Ns_TclPrintfResult(interp, "error reading \"%s\": %s",
+                           chanName, Tcl_PosixError(interp));
+        goto done;
+    }
+    if (sqlite3_blob_close(blob) != SQLITE_OK) {
+        blob = NULL;
+        goto error;
+    }
+    blob = NULL;
+    if (TxnStep(ltHandle, LITE_TXN_COMMIT) != SQLITE_OK) {
+        goto error;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(done));
+    status = TCL_OK;
+    goto done;
+
+ error:
+    ltHandle->stats.errors++;
+    Tcl_SetResult(interp, (char *) sqlite3_errmsg(ltHandle->conn), TCL_VOLATILE);
+
+ done:
+    (void) sqlite3_blob_close(blob);
+    ns_free(buf);
+    PutAux(ltHandle);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StatsObj --
+ *
+ *      Build a dict of counters.
+ *
+ * Results:
+ *      Tcl_Obj with zero ref count.
+ *
+ * Side effects:
+ *      The handles key is omitted if numHandles is negative.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+StatsObj(LiteStats *statsPtr, int numHandles)
+{
+    Tcl_Obj *dictObj = Tcl_NewDictObj();
+    int      i;
+
+    for (i = 0; counters[i].name != NULL; i++) {
+        (void) Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj(counters[i].name, -1),
+                              Tcl_NewWideIntObj(COUNTER(statsPtr, i)));
+    }
+    for (i = 0; times[i].name != NULL; i++) {
+        (void) Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj(times[i].name, -1),
+                              Tcl_NewDoubleObj((double) TIME(statsPtr, i)->sec
+                                               + TIME(statsPtr, i)->usec / 1e6));
+    }
+    for (i = 0; i < LITE_MEM_NUM; i++) {
+        (void) Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj(memory[i].name, -1),
+                              Tcl_NewWideIntObj(statsPtr->memory[i]));
+    }
+    if (numHandles >= 0) {
+        (void) Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("walpages", -1),
+                              Tcl_NewIntObj(statsPtr->walPages));
+        (void) Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("handles", -1),
+                              Tcl_NewIntObj(numHandles));
+    }
+    return dictObj;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SumStats --
+ *
+ *      Sum the counters of closed and open handles of a pool.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Counters of open handles are read while they may be updated,
+ *      so the sum is approximate.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SumStats(LiteConfig *ltCfg, LiteStats *statsPtr, int *numPtr)
+{
+    LiteHandle *ltHandle;
+    int         n = 0;
+
+    Ns_MutexLock(&ltCfg->lock);
+    *statsPtr = ltCfg->stats;
+    for (ltHandle = ltCfg->livePtr; ltHandle != NULL;
+         ltHandle = ltHandle->nextLivePtr) {
+        AddStats(statsPtr, &ltHandle->stats);
+        n++;
+    }
+    Ns_MutexUnlock(&ltCfg->lock);
+
+    *numPtr = n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AddStats --
+ *
+ *      Add one set of counters to another.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AddStats(LiteStats *dstPtr, LiteStats *srcPtr)
+{
+    int i;
+
+    for (i = 0; counters[i].name != NULL; i++) {
+        COUNTER(dstPtr, i) += COUNTER(srcPtr, i);
+    }
+    for (i = 0; times[i].name != NULL; i++) {
+        Ns_IncrTime(TIME(dstPtr, i), TIME(srcPtr, i)->sec, TIME(srcPtr, i)->usec);
+    }
+    for (i = 0; i < LITE_MEM_NUM; i++) {
+        dstPtr->memory[i] += srcPtr->memory[i];
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueueInit --
+ *
+ *      Open the writer connection and start the group commit thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Group commit is disabled if the connection can't be opened.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+QueueInit(LiteConfig *ltCfg, CONST char *path)
+{
+    LiteQueue  *queue;
+    LiteHandle *ltHandle;
+    Ns_DString  ds;
+
+    Ns_DStringInit(&ds);
+    ltHandle = NewHandle(ltCfg, &ds);
+    if (ltHandle == NULL) {
+        Ns_Log(Error, "dbilite: %s: group commit disabled: %s",
+               ltCfg->module, Ns_DStringValue(&ds));
+        Ns_DStringFree(&ds);
+        return;
+    }
+    Ns_DStringFree(&ds);
+
+    queue = ns_calloc(1, sizeof(LiteQueue));
+    queue->ltHandle   = ltHandle;
+    queue->lastPtrPtr = &queue->firstPtr;
+    queue->maxBatch   = Ns_ConfigIntRange(path, "groupcommitmax", 1000, 1, INT_MAX);
+    queue->delay      = Ns_ConfigIntRange(path, "groupcommitdelay", 0, 0, 1000);
+    Ns_MutexInit(&queue->lock);
+    Ns_MutexSetName2(&queue->lock, "dbilite:queue", ltCfg->module);
+    Ns_CondInit(&queue->cond);
+    Ns_CondInit(&queue->doneCond);
+    Tcl_InitHashTable(&queue->stmts, TCL_STRING_KEYS);
+
+    ltCfg->queue = queue;
+    Ns_ThreadCreate(QueueThread, queue, 0, &queue->thread);
+    Ns_RegisterAtShutdown(QueueShutdown, queue);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueueWrite --
+ *
+ *      Hand a DML statement to the group commit writer and wait
+ *      for the batch it is part of to commit.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      Blocks the calling thread. The values remain owned by the
+ *      caller and are bound by the writer while we wait.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+QueueWrite(LiteHandle *ltHandle, Dbi_Statement *stmt,
+           Dbi_Value *values, unsigned int numValues)
+{
+    LiteQueue *queue = ltHandle->ltCfg->queue;
+    LiteWrite  write;
+
+    memset(&write, 0, sizeof(write));
+    write.sql       = stmt->sql;
+    write.length    = stmt->length;
+    write.values    = values;
+    write.numValues = numValues;
+
+    Ns_MutexLock(&queue->lock);
+    if (queue->shutdown) {
+        write.errmsg = ns_strdup("dbilite: group commit writer is shut down");
+    } else {
+        *queue->lastPtrPtr = &write;
+        queue->lastPtrPtr = &write.nextPtr;
+        queue->length++;
+        Ns_CondSignal(&queue->cond);
+        while (!write.done) {
+            Ns_CondWait(&queue->doneCond, &queue->lock);
+        }
+    }
+    Ns_MutexUnlock(&queue->lock);
+
+    if (write.errmsg != NULL) {
+        Dbi_SetException(ltHandle->handle, "SQLIT", "%s", write.errmsg);
+        ns_free(write.errmsg);
+        return NS_ERROR;
+    }
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueueThread --
+ *
+ *      Drain the group commit queue, running each batch of writes in
+ *      a single transaction.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Waiting submitters are woken after each batch.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+QueueThread(void *arg)
+{
+    LiteQueue      *queue = arg;
+    LiteWrite      *firstPtr, *writePtr, **lastPtrPtr;
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    Ns_Time         timeout;
+    int             n;
+
+    Ns_ThreadSetName("-dbilite:%s-", queue->ltHandle->ltCfg->module);
+
+    Ns_MutexLock(&queue->lock);
+    for (;;) {
+        while (queue->firstPtr == NULL && !queue->shutdown) {
+            Ns_CondWait(&queue->cond, &queue->lock);
+        }
+        if (queue->firstPtr == NULL) {
+            break;
+        }
+
+        /*
+         * Give other threads a chance to join the batch.
+         */
+
+        if (queue->delay > 0 && !queue->shutdown) {
+            Ns_GetTime(&timeout);
+            Ns_IncrTime(&timeout, 0, queue->delay * 1000);
+            while (queue->length < queue->maxBatch && !queue->shutdown
+                   && Ns_CondTimedWait(&queue->cond, &queue->lock, &timeout)
+                      == NS_OK) {
+                ;
+            }
+        }
+
+        firstPtr = queue->firstPtr;
+        lastPtrPtr = &queue->firstPtr;
+        for (n = 0; *lastPtrPtr != NULL && n < queue->maxBatch; n++) {
+            lastPtrPtr = &(*lastPtrPtr)->nextPtr;
+        }
+        queue->firstPtr = *lastPtrPtr;
+        *lastPtrPtr = NULL;
+        if (queue->firstPtr == NULL) {
+            queue->lastPtrPtr = &queue->firstPtr;
+        }
+        queue->length -= n;
+        Ns_MutexUnlock(&queue->lock);
+
+        QueueBatch(queue, firstPtr);
+
+        Ns_MutexLock(&queue->lock);
+        for (writePtr = firstPtr; writePtr != NULL; writePtr = writePtr->nextPtr) {
+            writePtr->done = 1;
+        }
+        Ns_CondBroadcast(&queue->doneCond);
+    }
+    Ns_MutexUnlock(&queue->lock);
+
+    hPtr = Tcl_FirstHashEntry(&queue->stmts, &search);
+    while (hPtr != NULL) {
+        (void) sqlite3_finalize(Tcl_GetHashValue(hPtr));
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&queue->stmts);
+    FreeHandle(queue->ltHandle);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueueBatch --
+ *
+ *      Run a batch of writes inside one immediate transaction. Each
+ *      write runs in its own savepoint so that a failing statement
+ *      is rolled back without affecting the others.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      errmsg is set for each write which failed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+QueueBatch(LiteQueue *queue, LiteWrite *firstPtr)
+{
+    LiteHandle    *ltHandle = queue->ltHandle;
+    sqlite3       *conn = ltHandle->conn;
+    LiteWrite     *writePtr;
+    sqlite3_stmt  *st;
+    Tcl_HashEntry *hPtr;
+    char          *errmsg = NULL;
+    Ns_Time        wait;
+    int            isNew, rc;
+
+    wait.sec = wait.usec = 0;
+
+    if (ltHandle->ltCfg->file != NULL
+            && WriteLock(ltHandle, LITE_LOCK_TXN, LITE_SCHEMA_ALL) != NS_OK) {
+        errmsg = ns_strdup("write lock still busy");
+    } else if (TxnStep(ltHandle, LITE_TXN_BEGIN_IMMEDIATE) != SQLITE_OK) {
+        errmsg = ns_strdup(sqlite3_errmsg(conn));
+    }
+
+    for (writePtr = firstPtr;
+         writePtr != NULL && errmsg == NULL;
+         writePtr = writePtr->nextPtr) {
+
+        hPtr = Tcl_CreateHashEntry(&queue->stmts, writePtr->sql, &isNew);
+        if (isNew) {
+            if (sqlite3_prepare_v3(conn, writePtr->sql, writePtr->length,
+                                   SQLITE_PREPARE_PERSISTENT, &st, NULL)
+                    != SQLITE_OK) {
+                writePtr->errmsg = ns_strdup(sqlite3_errmsg(conn));
+                Tcl_DeleteHashEntry(hPtr);
+                continue;
+            }
+            Tcl_SetHashValue(hPtr, st);
+        } else {
+            st = Tcl_GetHashValue(hPtr);
+        }
+
+        (void) TxnStep(ltHandle, LITE_TXN_SAVEPOINT);
+        rc = BindValues(st, writePtr->values, writePtr->numValues,
+                        ltHandle->ltCfg->bindMode);
+        if (rc == SQLITE_OK) {
+            rc = StepStmt(ltHandle, st, &wait);
+        }
+        if (rc != SQLITE_DONE) {
+            ltHandle->stats.errors++;
+            writePtr->errmsg = ns_strdup(sqlite3_errmsg(conn));
+        }
+        (void) sqlite3_reset(st);
+        (void) sqlite3_clear_bindings(st);
+        if (writePtr->errmsg != NULL) {
+            (void) TxnStep(ltHandle, LITE_TXN_ROLLBACK_TO);
+        }
+        (void) TxnStep(ltHandle, LITE_TXN_RELEASE);
+    }
+
+    if (errmsg == NULL
+            && TxnStep(ltHandle, LITE_TXN_COMMIT) != SQLITE_OK) {
+        errmsg = ns_strdup(sqlite3_errmsg(conn));
+        (void) TxnStep(ltHandle, LITE_TXN_ROLLBACK);
+    }
+    if (errmsg != NULL) {
+        for (writePtr = firstPtr; writePtr != NULL; writePtr = writePtr->nextPtr) {
+            if (writePtr->errmsg == NULL) {
+                writePtr->errmsg = ns_strdup(errmsg);
+            }
+        }
+        ns_free(errmsg);
+    }
+
+    WriteUnlock(ltHandle, LITE_LOCK_TXN);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueueShutdown --
+ *
+ *      Stop the group commit writer once the queue is drained.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes submitted after shutdown fail.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+QueueShutdown(const Ns_Time *UNUSED(toPtr), void *arg)
+{
+    LiteQueue *queue = arg;
+
+    Ns_MutexLock(&queue->lock);
+    queue->shutdown = 1;
+    Ns_CondSignal(&queue->cond);
+    Ns_MutexUnlock(&queue->lock);
+
+    Ns_ThreadJoin(&queue->thread, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReplicaInit --
+ *
+ *      Load the datasource file into the shared in-memory database of
+ *      a replica pool and start the write-back thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The replica starts empty if the file can't be read. Nothing
+ *      is written back for readonly pools.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReplicaInit(LiteConfig *ltCfg, CONST char *path)
+{
+    LiteReplica *replica;
+    sqlite3     *conn;
+    CONST char  *file;
+    int          flags, rc;
+
+    file = Ns_ConfigString(path, "datasource", ":memory:");
+    if (*file == '\0' || strcmp(file, ":memory:") == 0) {
+        return;
+    }
+    flags = ltCfg->openFlags & SQLITE_OPEN_READONLY
+        ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+    rc = sqlite3_open_v2(file, &conn, flags | SQLITE_OPEN_URI, NULL);
+    if (rc == SQLITE_OK) {
+        (void) sqlite3_busy_timeout(conn, ltCfg->busyTimeout);
+        rc = Backup(ltCfg->keeper, conn, -1);
+    }
+    if (rc != SQLITE_OK) {
+        Ns_Log(Error, "dbilite: %s: could not load replica from %s: %s",
+               ltCfg->module, file, sqlite3_errstr(rc));
+    }
+    (void) sqlite3_close(conn);
+
+    if (flags & SQLITE_OPEN_READONLY) {
+        return;
+    }
+
+    replica = ns_calloc(1, sizeof(LiteReplica));
+    replica->ltCfg    = ltCfg;
+    replica->path     = file;
+    replica->interval = Ns_ConfigIntRange(path, "replicainterval", 60, 0, INT_MAX);
+    replica->pages    = Ns_ConfigIntRange(path, "replicapages", 256, 1, INT_MAX);
+    replica->version  = DataVersion(ltCfg->keeper);
+    Ns_MutexInit(&replica->lock);
+    Ns_MutexSetName2(&replica->lock, "dbilite:replica", ltCfg->module);
+    Ns_CondInit(&replica->cond);
+
+    ltCfg->replica = replica;
+    Ns_ThreadCreate(ReplicaThread, replica, 0, &replica->thread);
+    Ns_RegisterAtShutdown(ReplicaShutdown, replica);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReplicaThread --
+ *
+ *      Write the replica back to disk every interval, and a last time
+ *      at shutdown.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReplicaThread(void *arg)
+{
+    LiteReplica *replica = arg;
+    Ns_Time      timeout;
+    int          shutdown;
+
+    Ns_ThreadSetName("-dbilite:%s:replica-", replica->ltCfg->module);
+
+    Ns_MutexLock(&replica->lock);
+    do {
+        if (replica->interval > 0) {
+            Ns_GetTime(&timeout);
+            Ns_IncrTime(&timeout, replica->interval, 0);
+            while (!replica->shutdown
+                   && Ns_CondTimedWait(&replica->cond, &replica->lock, &timeout)
+                      == NS_OK) {
+                ;
+            }
+        } else {
+            while (!replica->shutdown) {
+                Ns_CondWait(&replica->cond, &replica->lock);
+            }
+        }
+        shutdown = replica->shutdown;
+        Ns_MutexUnlock(&replica->lock);
+
+        (void) ReplicaWrite(replica);
+
+        Ns_MutexLock(&replica->lock);
+    } while (!shutdown);
+    Ns_MutexUnlock(&replica->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReplicaWrite --
+ *
+ *      Copy the replica to its file if it changed since the last time.
+ *
+ * Results:
+ *      NS_OK / NS_ERROR.
+ *
+ * Side effects:
+ *      The copy restarts whenever a handle writes to the replica
+ *      between backup steps.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ReplicaWrite(LiteReplica *replica)
+{
+    LiteConfig   *ltCfg = replica->ltCfg;
+    sqlite3      *conn;
+    unsigned int  version;
+    int           rc;
+
+    version = DataVersion(ltCfg->keeper);
+    if (version != 0u && version == replica->version) {
+        return NS_OK;
+    }
+
+    rc = sqlite3_open_v2(replica->path, &conn,
+                         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+                         | SQLITE_OPEN_URI, NULL);
+    if (rc == SQLITE_OK) {
+        (void) sqlite3_busy_timeout(conn, ltCfg->busyTimeout);
+        rc = Backup(conn, ltCfg->keeper, replica->pages);
+    }
+    (void) sqlite3_close(conn);
+
+    if (rc != SQLITE_OK) {
+        Ns_Log(Error, "dbilite: %s: could not write replica to %s: %s",
+               ltCfg->module, replica->path, sqlite3_errstr(rc));
+        return NS_ERROR;
+    }
+    replica->version = version;
+    Ns_Log(Debug, "dbilite: %s: replica written to %s",
+           ltCfg->module, replica->path);
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DataVersion --
+ *
+ *      Get the data version of the main database of a connection.
+ *
+ * Results:
+ *      Version which changes with every commit by another connection,
+ *      or 0 if it couldn't be read.
+ *
+ * Side effects:
+ *      Runs pragma data_version to start a read transaction, without
+ *      which sqlite doesn't update the version of an idle connection.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+DataVersion(sqlite3 *conn)
+{
+    unsigned int version = 0u;
+
+    if (sqlite3_exec(conn, "pragma data_version", NULL, NULL, NULL) != SQLITE_OK
+            || sqlite3_file_control(conn, "main", SQLITE_FCNTL_DATA_VERSION,
+                                    &version) != SQLITE_OK) {
+        return 0u;
+    }
+    return version;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReplicaShutdown --
+ *
+ *      Stop the write-back thread after a final write-back.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Waits for the thread to exit.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReplicaShutdown(const Ns_Time *UNUSED(toPtr), void *arg)
+{
+    LiteReplica *replica = arg;
+
+    Ns_MutexLock(&replica->lock);
+    replica->shutdown = 1;
+    Ns_CondSignal(&replica->cond);
+    Ns_MutexUnlock(&replica->lock);
+
+    Ns_ThreadJoin(&replica->thread, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Backup --
+ *
+ *      Copy the main database of src to dst, pages at a time, or all
+ *      at once if pages is negative.
+ *
+ * Results:
+ *      sqlite result code.
+ *
+ * Side effects:
+ *      Sleeps between steps so that handles of src aren't starved,
+ *      and gives up if src or dst stay locked for about a second.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Backup(sqlite3 *dst, sqlite3 *src, int pages)
+{
+    sqlite3_backup *backup;
+    int             rc, busy = 0;
+
+    backup = sqlite3_backup_init(dst, "main", src, "main");
+    if (backup == NULL) {
+        return sqlite3_errcode(dst);
+    }
+    for (;;) {
+        rc = sqlite3_backup_step(backup, pages);
+        if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+            if (++busy > 1000) {
+                break;
+            }
+        } else if (rc != SQLITE_OK) {
+            break;
+        } else {
+            busy = 0;
+        }
+        (void) sqlite3_sleep(1);
+    }
+
+    if (sqlite3_backup_finish(backup) != SQLITE_OK && rc == SQLITE_DONE) {
+        return sqlite3_errcode(dst);
+    }
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
 /*
  * Local Variables:
  * mode: c
@@ -1,11 +1,153 @@
 #
 # nsdbilite configuration example.
 #
-#     The nsdbilite SQLite database driver takes two
-#     extra configuration parameters: datasource and sqlitebusyretries.
+#     The nsdbilite SQLite database driver takes the following
+#     extra configuration parameters.
 #
-#     datasource: a path in the filesystem, or the special token :memory:
-#     sqlitebusyretries: default 100
+#     datasource: a path in the filesystem, the special token :memory:,
+#                 or a file: URI.
+#     sharedmemory: all handles of the pool share one in-memory database,
+#                   named after the datasource, or the pool if that is
+#                   :memory:, which lives until the server exits,
+#                   default false. Handles of pools with the same name
+#                   share the database as well.
+#     replica: like sharedmemory, but the database is loaded from the
+#              datasource file at startup and written back to it with
+#              the backup api, when changed, every replicainterval
+#              seconds (default 60, 0 for only at shutdown), copying
+#              replicapages pages at a time (default 256). Nothing is
+#              written back if readonly. Default false.
+#     sqlitebusyretries: max times to sleep waiting for a lock, default 100,
+#                        0 for no limit.
+#     busyhandler: how to wait for a lock held by another connection:
+#                  timeout (default): sleep on the sqlite3_busy_timeout schedule.
+#                  backoff: exponential backoff with jitter.
+#                  notify: block with sqlite3_unlock_notify when a shared
+#                          cache table lock is held (needs sqlite and the
+#                          driver built with SQLITE_ENABLE_UNLOCK_NOTIFY),
+#                          backoff otherwise.
+#     busytimeout: max msec to wait for a lock, default 5000.
+#     busybackoffmin, busybackoffmax: backoff range in msec, default 1, 100.
+#     readonly: open the datasource read-only, default false.
+#     immutable: the datasource never changes while the server runs, so
+#                open it read-only as a file: URI with immutable=1,
+#                without locking or change detection, with query_only
+#                set, transactions ignored and mmap_size defaulting to
+#                1GB, default false.
+#     openflags: list of flags for sqlite3_open_v2: nomutex, fullmutex,
+#                readonly, uri, nofollow, sharedcache, privatecache.
+#                Default nomutex, as a handle is used by one thread at a
+#                time. Datasources are always opened as URIs.
+#     multithread: switch sqlite to multi-thread mode, without mutexes
+#                  on connections, at startup, default false. This
+#                  applies to the process and only in the first pool
+#                  loaded.
+#     serializewrites: queue writers to the datasource in order of arrival
+#                      with a lock shared by all pools of the server
+#                      rather than racing for the sqlite lock, default false.
+#                      Transactions begin immediate and hold the lock until
+#                      commit or rollback, so send reads to a readonly pool.
+#                      A writer which waits longer than busytimeout for the
+#                      lock fails as busy.
+#     openhandles: connections opened in parallel at startup, with the
+#                  schema loaded and statements prepared, which Open()
+#                  then uses, default 0. At most maxhandles are opened.
+#     warmquery: a statement run to completion once at startup to load
+#                the pages of hot tables and indexes into the page cache
+#                of the OS, or the mmap region. May be repeated.
+#     warmfile: read the whole database file once at startup, default
+#               false.
+#     functions: register the SQL functions regexp(pattern, string),
+#                behind the REGEXP operator, with Tcl regular expressions,
+#                and levenshtein(a, b), both usable in indexes, default
+#                true.
+#     extension: path of a sqlite extension loaded into each handle and
+#                optionally its entry point, e.g. {/usr/lib/spellfix.so}.
+#                May be repeated.
+#     shard: a schema name and a datasource, attached to each handle.
+#            Repeat for each shard, up to 31. With serializewrites on a
+#            file datasource, each shard has its own write lock and a
+#            statement outside of a transaction takes only the locks of
+#            the shards it writes, so writers to different shards run in
+#            parallel. Transactions lock all shards. dbilite::shard maps
+#            a key to a shard.
+#     groupcommit: DML run outside of a transaction is queued for a
+#                  background writer which commits batches of writes from
+#                  many threads in a single transaction, default false.
+#                  Each caller waits for its batch and sees its own error.
+#     groupcommitmax: max writes per batch, default 1000.
+#     groupcommitdelay: msec to wait for a batch to fill, default 0.
+#     bindtypes: how bind variables are passed to sqlite:
+#                text (default): always as text.
+#                integer: canonical integers, e.g. 42 but not 042, as int64.
+#                numeric: also canonical reals, e.g. 1.5 but not 1.50, as double.
+#     prepare: a statement to prepare on each new handle, so the first
+#              query after a handle is recycled need not compile it.
+#              Write bind variables as ? as nsdbi passes them to the
+#              driver. May be repeated.
+#     preparefile: a file of such statements separated by semicolons.
+#     resultcache: KB of memory for a cache of the rows of read-only
+#                  queries by SQL and values, served without running the
+#                  query again until the database changes, default 0 for
+#                  off. Least recently used results are dropped when full.
+#                  Queries calling random(), changes(), last_insert_rowid()
+#                  or the date and time functions aren't cached. Functions
+#                  of extensions are assumed to be deterministic. Ignored
+#                  for pools with shards.
+#     resultcachemax: KB for the largest result cached, default 1/8 of
+#                     resultcache.
+#     checkpointinterval: seconds between WAL checkpoints run by the
+#                         scheduler on a connection of its own rather
+#                         than by the request which commits past
+#                         wal_autocheckpoint, default 0 for off.
+#     checkpointlimit: WAL size in pages above which the checkpoint also
+#                      truncates the WAL, default 10000.
+#     optimize: run PRAGMA optimize, which analyzes tables with stale
+#               statistics, when a handle closes and on each maintenance
+#               run, default false.
+#     maintenanceinterval: seconds between maintenance runs by the
+#                          scheduler on a connection of its own, which
+#                          optimize and release free pages, default 0
+#                          for off.
+#     maintenancetime: msec a maintenance run may take before it is
+#                      interrupted, default 100.
+#     vacuumpages: pages released per incremental_vacuum by a run when
+#                  auto_vacuum is incremental, default 0 for off.
+#     idlememory: KB of page cache a handle may use when returned to
+#                 the pool. Above that, all of its unused page cache is
+#                 released, not just the excess, default -1 for no limit.
+#     lookasidesize, lookasidecount: bytes per slot and slots of the
+#                                    lookaside allocator of each handle
+#                                    for small objects, default sqlite's.
+#     nsmalloc: route all sqlite allocations through ns_malloc, which
+#               caches memory per thread, default false.
+#     pagecachepages: pages of a page cache preallocated for sqlite,
+#                     shared by all handles, default 0 for none.
+#     pagecachepagesize: largest page size served from it, default 4096.
+#                        nsmalloc and pagecache* apply to the process and
+#                        only work in the first pool loaded.
+#     softheaplimit, hardheaplimit: KB of memory for sqlite in the whole
+#                                   process, see sqlite3_soft_heap_limit64,
+#                                   default 0 for none. Set in one pool.
+#     statementtimeout: msec a statement may run, from execution to its
+#                       last row, before it is interrupted with exception
+#                       code SQTMO, default 0 for no limit.
+#     slowquerytime: log statements which take longer than this many msec
+#                    from first step to reset, with their bound values and
+#                    sqlite's full scan, sort, automatic index, VM step and
+#                    reprepare counts, default 0 for off.
+#
+#     The following are run as pragmas on each new connection, if set:
+#
+#     journal_mode: delete, truncate, persist, memory, wal or off
+#     synchronous: off, normal, full or extra
+#     temp_store: default, file or memory
+#     cache_size: pages, or KiB if negative
+#     mmap_size: bytes
+#     wal_autocheckpoint: pages
+#     auto_vacuum: none, full or incremental, only for new databases
+#     analysis_limit: rows examined per index by ANALYZE and optimize
+#     pragma: any other pragma, e.g. "foreign_keys = on". May be repeated.
 #
 
 
@@ -43,4 +185,50 @@ ns_param   checkinterval  600  ;# Check for idle handles every 10 minutes.
 # which database file to connect to.
 #
 ns_param   datasource     ":memory:"
+#ns_param   sharedmemory   true    ;# One in-memory db for all handles.
+#ns_param   openflags      {nomutex nofollow}
+#ns_param   immutable      true    ;# A reference db shipped as a file.
+#ns_param   replica        true    ;# Serve a file from memory.
+#ns_param   extension      /usr/local/lib/sqlite/spellfix.so
+#ns_param   shard          {s1 /var/db/s1.db}  ;# Query as s1.tablename.
+#ns_param   shard          {s2 /var/db/s2.db}
 #ns_param   sqlitebusyretries     100
+#ns_param   busyhandler    backoff
+#ns_param   busytimeout    5000    ;# Give up after 5 seconds.
+#ns_param   bindtypes      integer ;# Integer keys compare as integers.
+#ns_param   prepare        "select b from test where a = ?"
+#ns_param   openhandles    4       ;# Ready before the first request.
+#ns_param   warmquery      "select count(*) from test indexed by test_a_idx"
+#ns_param   slowquerytime  250     ;# Log queries slower than 250 msec.
+#ns_param   statementtimeout 10000 ;# Stop runaway queries after 10 seconds.
+#
+# Connection tuning.
+#
+#ns_param   journal_mode   wal     ;# Readers don't block the writer.
+#ns_param   synchronous    normal  ;# Safe with wal, no fsync per commit.
+#ns_param   temp_store     memory
+#ns_param   cache_size     -16384  ;# 16MB page cache per handle.
+#ns_param   idlememory     2048    ;# Free the cache of handles over 2MB.
+#ns_param   softheaplimit  524288  ;# Aim for 512MB for all of sqlite.
+#ns_param   mmap_size      268435456
+#ns_param   wal_autocheckpoint 1000
+#ns_param   pragma         "foreign_keys = on"
+
+
+#
+# Reader / writer split: pool2 above serves reads,
+# a second pool on the same file serializes all writes.
+#
+#ns_param   readonly       true
+#ns_param   resultcache    65536   ;# 64MB of query results.
+
+#ns_section "ns/server/server1/module/pool2writer"
+#ns_param   datasource     /path/to/db
+#ns_param   journal_mode   wal
+#ns_param   checkpointinterval 5
+#ns_param   optimize       true
+#ns_param   maintenanceinterval 3600
+#ns_param   vacuumpages    100     ;# With auto_vacuum incremental.
+#ns_param   serializewrites true
+#ns_param   groupcommit    true
+#ns_param   groupcommitdelay 2
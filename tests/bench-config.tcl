@@ -0,0 +1,71 @@
+#
+# sqlite benchmark config.
+#
+
+
+set homedir   [pwd]
+set bindir    [file dirname [ns_info nsd]]
+set benchdir  [file join [ns_info tmpdir] nsdbilite-bench]
+
+file delete -force $benchdir
+file mkdir $benchdir
+
+
+
+#
+# Global AOLserver parameters.
+#
+
+ns_section "ns/parameters"
+ns_param   home           $homedir
+ns_param   tcllibrary     $bindir/../tcl
+ns_param   logdebug       false
+
+ns_section "ns/servers"
+ns_param   server1         "Server One"
+
+
+#
+# Server One configuration.
+#
+
+ns_section "ns/server/server1/tcl"
+ns_param   initfile        ${bindir}/init.tcl
+
+ns_section "ns/server/server1/modules"
+ns_param   rollback        $homedir/nsdbilite.so
+ns_param   wal             $homedir/nsdbilite.so
+ns_param   memory          $homedir/nsdbilite.so
+ns_param   perthread       $homedir/nsdbilite.so
+
+
+#
+# Database configuration, one file each.
+#
+
+ns_section "ns/server/server1/module/rollback"
+ns_param   datasource      $benchdir/rollback.db
+ns_param   maxhandles      16
+ns_param   journal_mode    delete
+ns_param   busytimeout     30000
+
+ns_section "ns/server/server1/module/wal"
+ns_param   datasource      $benchdir/wal.db
+ns_param   maxhandles      16
+ns_param   journal_mode    wal
+ns_param   synchronous     normal
+ns_param   serializewrites true
+ns_param   checkpointinterval 1
+
+ns_section "ns/server/server1/module/memory"
+ns_param   datasource      :memory:
+ns_param   maxhandles      16
+ns_param   sharedmemory    true
+ns_param   busytimeout     30000
+
+ns_section "ns/server/server1/module/perthread"
+ns_param   datasource      $benchdir/perthread.db
+ns_param   maxhandles      0
+ns_param   journal_mode    wal
+ns_param   synchronous     normal
+ns_param   serializewrites true
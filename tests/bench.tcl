@@ -0,0 +1,167 @@
+#
+# The contents of this file are subject to the Mozilla Public License
+# Version 1.1 (the "License"); you may not use this file except in
+# compliance with the License. You may obtain a copy of the License at
+# http://mozilla.org/
+#
+# Software distributed under the License is distributed on an "AS IS"
+# basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+# the License for the specific language governing rights and limitations
+# under the License.
+#
+# Copyright 2006 (C) Stephen Deasey <sdeasey@gmail.com>
+#
+# Alternatively, the contents of this file may be used under the terms
+# of the GNU General Public License (the "GPL"), in which case the
+# provisions of GPL are applicable instead of those above.  If you wish
+# to allow use of your version of this file only under the terms of the
+# GPL and not to allow others to use your version of this file under the
+# License, indicate your decision by deleting the provisions above and
+# replace them with the notice and other provisions required by the GPL.
+# If you do not delete the provisions above, a recipient may use your
+# version of this file under either the License or the GPL.
+#
+
+#
+# bench.tcl --
+#
+#       Measure the throughput and latency of each workload on each
+#       pool of bench-config.tcl from 1 to N threads. Execute it by
+#       invoking "make bench".
+#
+#       Environment:
+#
+#       BENCH_POOLS:     pools to run, default all of bench-config.tcl.
+#       BENCH_WORKLOADS: point, range, insert and/or mixed.
+#       BENCH_THREADS:   thread counts, default {1 2 4 8}.
+#       BENCH_SECONDS:   seconds per run, default 2.
+#       BENCH_ROWS:      rows loaded into each pool, default 10000.
+#       BENCH_OUTPUT:    results file, one JSON object per line per run,
+#                        default bench_output.txt.
+#
+
+proc setting {name default} {
+    if {[info exists ::env($name)] && $::env($name) ne ""} {
+        return $::env($name)
+    }
+    return $default
+}
+
+set pools     [setting BENCH_POOLS     {rollback wal memory perthread}]
+set workloads [setting BENCH_WORKLOADS {point range insert mixed}]
+set threads   [setting BENCH_THREADS   {1 2 4 8}]
+set seconds   [setting BENCH_SECONDS   2]
+set rows      [setting BENCH_ROWS      10000]
+set output    [setting BENCH_OUTPUT    bench_output.txt]
+
+
+#
+# The script run by each thread: run a workload until the deadline
+# and return the latency of each operation in microseconds.
+#
+
+set worker {
+    set pool     %POOL%
+    set workload %WORKLOAD%
+    set rows     %ROWS%
+    set begin    %BEGIN%
+    set deadline %DEADLINE%
+    set id       %ID%
+    set lat      [list]
+    set n        0
+
+    while {[clock microseconds] < $begin} {
+        after 1
+    }
+    while {[set start [clock microseconds]] < $deadline} {
+        set k [expr {int(rand() * $rows) + 1}]
+        switch -- $workload {
+            point {
+                dbi_rows -db $pool {select v from kv where k = :k}
+            }
+            range {
+                dbi_rows -db $pool {select k, v from kv where k between :k and :k + 99}
+            }
+            insert {
+                set batch [list]
+                for {set i 0} {$i < 100} {incr i} {
+                    lappend batch [list $id $n.$i]
+                }
+                dbilite::dml_many -db $pool -transaction \
+                    {insert into log (t, v) values (?, ?)} $batch
+            }
+            mixed {
+                if {$n % 10 == 0} {
+                    dbi_dml -db $pool {update kv set v = :n where k = :k}
+                } else {
+                    dbi_rows -db $pool {select v from kv where k = :k}
+                }
+            }
+        }
+        lappend lat [expr {[clock microseconds] - $start}]
+        incr n
+    }
+    return $lat
+}
+
+proc load {pool rows} {
+    dbi_dml -db $pool {create table if not exists kv (k integer primary key, v text not null)}
+    dbi_dml -db $pool {create table if not exists log (t integer not null, v text not null)}
+    dbi_dml -db $pool {delete from kv}
+    set batch [list]
+    for {set k 1} {$k <= $rows} {incr k} {
+        lappend batch [list $k [string repeat x 100]]
+    }
+    dbilite::dml_many -db $pool -transaction {insert into kv (k, v) values (?, ?)} $batch
+}
+
+proc percentile {sorted p} {
+    set n [llength $sorted]
+    if {$n == 0} {
+        return 0
+    }
+    set i [expr {max(0, int(ceil($p * $n)) - 1)}]
+    return [lindex $sorted $i]
+}
+
+proc run {pool workload numThreads seconds rows} {
+    #
+    # Workers wait for a common start, leaving time for all of them
+    # to start, so that each runs for the given seconds.
+    #
+
+    set begin    [expr {[clock microseconds] + 200000}]
+    set deadline [expr {$begin + $seconds * 1000000}]
+    set tids [list]
+    for {set id 0} {$id < $numThreads} {incr id} {
+        lappend tids [ns_thread begin [string map [list \
+            %POOL% $pool %WORKLOAD% $workload %ROWS% $rows \
+            %BEGIN% $begin %DEADLINE% $deadline %ID% $id] $::worker]]
+    }
+    set lat [list]
+    foreach tid $tids {
+        lappend lat {*}[ns_thread wait $tid]
+    }
+    set lat [lsort -integer $lat]
+    set ops [llength $lat]
+
+    return [format {{"pool":"%s","workload":"%s","threads":%d,"seconds":%s,"ops":%d,"opsPerSec":%.1f,"p50us":%d,"p95us":%d,"p99us":%d,"maxus":%d}} \
+                $pool $workload $numThreads $seconds $ops [expr {double($ops) / $seconds}] \
+                [percentile $lat 0.50] [percentile $lat 0.95] \
+                [percentile $lat 0.99] [percentile $lat 1.0]]
+}
+
+
+set chan [open $output w]
+foreach pool $pools {
+    load $pool $rows
+    foreach workload $workloads {
+        foreach n $threads {
+            set result [run $pool $workload $n $seconds $rows]
+            puts $chan $result
+            flush $chan
+            puts $result
+        }
+    }
+}
+close $chan
@@ -5,6 +5,13 @@
 
 set homedir   [pwd]
 set bindir    [file dirname [ns_info nsd]]
+set dbfile    [file join [ns_info tmpdir] nsdbilite-test.db]
+set replfile  [file join [ns_info tmpdir] nsdbilite-replica.db]
+set shardfile [file join [ns_info tmpdir] nsdbilite-shard]
+set staticfile [file join [ns_info tmpdir] nsdbilite-static.db]
+
+file delete -force $dbfile $dbfile-wal $dbfile-shm $replfile \
+    $shardfile.db $shardfile-1.db $shardfile-2.db $staticfile
 
 
 
@@ -39,6 +46,16 @@ ns_param   initfile        ${bindir}/init.tcl
 ns_section "ns/server/server1/modules"
 ns_param   pool1           $homedir/nsdbilite.so
 ns_param   thread           $homedir/nsdbilite.so
+ns_param   tuned            $homedir/nsdbilite.so
+ns_param   writer           $homedir/nsdbilite.so
+ns_param   reader           $homedir/nsdbilite.so
+ns_param   cached           $homedir/nsdbilite.so
+ns_param   batch            $homedir/nsdbilite.so
+ns_param   shared           $homedir/nsdbilite.so
+ns_param   replica          $homedir/nsdbilite.so
+ns_param   static           $homedir/nsdbilite.so
+ns_param   staticload       $homedir/nsdbilite.so
+ns_param   sharded          $homedir/nsdbilite.so
 
 
 #
@@ -47,6 +64,7 @@ ns_param   thread           $homedir/nsdbilite.so
 
 ns_section "ns/module/global1"
 ns_param   maxhandles      2
+ns_param   nsmalloc        true
 
 ns_section "ns/module/global2"
 ns_param   maxhandles      2
@@ -62,4 +80,77 @@ ns_param   checkinterval   30          ;# Check for stale handles every 15 secon
 
 ns_section "ns/server/server1/module/thread"
 ns_param   datasource      :memory:    ;# in-memory database
-ns_param   maxhandles      0
\ No newline at end of file
+ns_param   maxhandles      0
+ns_param   openflags       {fullmutex privatecache}
+
+ns_section "ns/server/server1/module/tuned"
+ns_param   datasource      :memory:
+ns_param   maxhandles      2
+ns_param   synchronous     normal
+ns_param   cache_size      -1024
+ns_param   temp_store      memory
+ns_param   pragma          "foreign_keys = on"
+ns_param   bindtypes       numeric
+ns_param   lookasidesize   128
+ns_param   lookasidecount  256
+ns_param   prepare         "select 1 + ?"
+ns_param   prepare         "select nonesuch from nonesuch"
+
+ns_section "ns/server/server1/module/writer"
+ns_param   datasource      $dbfile
+ns_param   maxhandles      10
+ns_param   journal_mode    wal
+ns_param   serializewrites true
+ns_param   checkpointinterval 1
+ns_param   openhandles     2
+ns_param   warmquery       "select count(*) from sqlite_master"
+ns_param   warmfile        true
+
+ns_section "ns/server/server1/module/reader"
+ns_param   datasource      $dbfile
+ns_param   maxhandles      2
+ns_param   readonly        true
+ns_param   resultcache     64
+
+ns_section "ns/server/server1/module/cached"
+ns_param   datasource      $dbfile
+ns_param   maxhandles      2
+ns_param   resultcache     64
+
+ns_section "ns/server/server1/module/batch"
+ns_param   datasource      $dbfile
+ns_param   maxhandles      8
+ns_param   serializewrites true
+ns_param   groupcommit     true
+ns_param   groupcommitdelay 5
+
+ns_section "ns/server/server1/module/shared"
+ns_param   datasource      :memory:
+ns_param   maxhandles      2
+ns_param   sharedmemory    true
+
+ns_section "ns/server/server1/module/replica"
+ns_param   datasource      $replfile
+ns_param   maxhandles      2
+ns_param   replica         true
+ns_param   replicainterval 1
+
+ns_section "ns/server/server1/module/static"
+ns_param   datasource      $staticfile
+ns_param   maxhandles      2
+ns_param   immutable       true
+
+ns_section "ns/server/server1/module/staticload"
+ns_param   datasource      $staticfile  ;# Written once, before static is used.
+ns_param   maxhandles      1
+
+ns_section "ns/server/server1/module/sharded"
+ns_param   datasource      $shardfile.db
+ns_param   maxhandles      2
+ns_param   serializewrites true
+ns_param   shard           [list s1 $shardfile-1.db]
+ns_param   shard           [list s2 $shardfile-2.db]
+ns_param   auto_vacuum     incremental
+ns_param   optimize        true
+ns_param   maintenanceinterval 1
+ns_param   vacuumpages     8